@@ -2,12 +2,23 @@
 
 BlurEstimation::BlurEstimation(const cv::Mat &input)
 {
-    cv::Mat gray;
-    cv::cvtColor(input, gray, CV_RGB2GRAY);
-    gray.convertTo(_F, CV_32F);
+    cv::cvtColor(input, _gray, CV_RGB2GRAY);
+    if (flag_fused_kernel)
+        return;
+    _gray.convertTo(_F, CV_32F);
     blur();  // F->Bver,Bhor
 }
 
+float BlurEstimation::estimate(const cv::Mat &input)
+{
+    cv::cvtColor(input, _gray, CV_RGB2GRAY);
+    if (flag_fused_kernel)
+        return estimateFused();
+    _gray.convertTo(_F, CV_32F);
+    blur();
+    return estimate();
+}
+
 void BlurEstimation::blur()
 {
     float k[9] = {1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9, 1.f / 9};
@@ -20,6 +31,8 @@ void BlurEstimation::blur()
 
 float BlurEstimation::estimate()
 {
+    if (flag_fused_kernel)
+        return estimateFused();
     cv::Mat d_Bver, d_Bhor, d_Fver, d_Fhor;
     cv::Mat Vver, Vhor;
 
@@ -132,3 +145,103 @@ void BlurEstimation::calDifferenceVer(const cv::Mat &input, cv::Mat &output)
                 output.at<float>(row, col) = abs(input.at<float>(row, col) - input.at<float>(row, col - 1));
     }
 }
+
+//! Same as 'cv::BORDER_REFLECT_101' used by 'cv::filter2D()': gfedcb|abcdefgh|gfedcba
+static inline int reflect101(int idx, int len)
+{
+    if (len == 1)
+        return 0;
+    while (idx < 0 || idx >= len)
+        idx = (idx < 0) ? -idx : 2 * len - 2 - idx;
+    return idx;
+}
+
+//! Only estimate on one tile in the center of each cell in a 'grid_number' x 'grid_number' grid of the image.
+//! Each tile covers 'tile_ratio' of the width and height of its cell.
+void BlurEstimation::setTileSampling(int grid_number, float tile_ratio)
+{
+    _tile_grid_number = std::max(0, grid_number);
+    _tile_ratio = std::min(1.0f, std::max(0.0f, tile_ratio));
+}
+
+//! Fused version of 'estimate()' on the grayscale image '_gray'.
+float BlurEstimation::estimateFused()
+{
+    const cv::Mat *img = &_gray;
+    if (int(_pyramid.size()) < _pyramid_level)
+        _pyramid.resize(_pyramid_level);
+    for (int i = 0; i < _pyramid_level; ++i)
+    {
+        cv::pyrDown(*img, _pyramid[i]);
+        img = &_pyramid[i];
+    }
+    long long sums[4] = {0, 0, 0, 0};
+    if (_tile_grid_number == 0 || _tile_ratio >= 1.0f)
+        accumulateFusedSums(*img, sums);
+    else
+    {
+        // Sums of all tiles are used as the sums of the image
+        const int kMinTileSize = 10;  // at least a little more than the box filter size
+        for (int i = 0; i < _tile_grid_number; ++i)
+        {
+            int y0 = img->rows * i / _tile_grid_number, y1 = img->rows * (i + 1) / _tile_grid_number;
+            int height = std::min(y1 - y0, std::max(kMinTileSize, int((y1 - y0) * _tile_ratio)));
+            for (int j = 0; j < _tile_grid_number; ++j)
+            {
+                int x0 = img->cols * j / _tile_grid_number, x1 = img->cols * (j + 1) / _tile_grid_number;
+                int width = std::min(x1 - x0, std::max(kMinTileSize, int((x1 - x0) * _tile_ratio)));
+                cv::Rect tile(x0 + (x1 - x0 - width) / 2, y0 + (y1 - y0 - height) / 2, width, height);
+                accumulateFusedSums((*img)(tile), sums);
+            }
+        }
+    }
+    // V sums are accumulated 9 times larger to keep them integers
+    return estimationFinal(float(sums[2] / 9.0), float(sums[3] / 9.0), float(sums[0]), float(sums[1]));
+}
+
+//! Accumulate sums of F and V differences of a grayscale image in 'sums' as (s_Fver, s_Fhor, 9 * s_Vver, 9 * s_Vhor).
+/*!
+    Difference of two neighbor pixels after a 1x9 box filter only depends on two pixels 9 pixels apart:
+        B(c) - B(c - 1) = (F(c + 4) - F(c - 5)) / 9
+    so the blurred images are never computed. All differences are integers and V is accumulated as
+        9 * V = max(9 * |dF| - |F(c + 4) - F(c - 5)|, 0)
+    so the result is exact, and the inner loop has no branches and can be auto-vectorized by the compiler.
+    Same as the matrix method, sums are over all pixels except the first row and column.
+*/
+void BlurEstimation::accumulateFusedSums(const cv::Mat &gray, long long sums[4])
+{
+    const int rows = gray.rows, cols = gray.cols;
+    if (rows < 2 || cols < 2)
+        return;
+    _row_padded.resize(cols + 9);
+    unsigned char *pad = &_row_padded[0];
+    for (int row = 1; row < rows; ++row)
+    {
+        const unsigned char *cur = gray.ptr<unsigned char>(row);
+        const unsigned char *prev = gray.ptr<unsigned char>(row - 1);
+        const unsigned char *down = gray.ptr<unsigned char>(reflect101(row + 4, rows));
+        const unsigned char *up = gray.ptr<unsigned char>(reflect101(row - 5, rows));
+
+        // Current row with 5 reflected pixels on both sides, so pad[c] is the pixel at column c - 5
+        for (int c = 0; c < cols + 9; ++c)
+            pad[c] = cur[reflect101(c - 5, cols)];
+
+        int s_fver = 0, s_fhor = 0, s_vver = 0, s_vhor = 0;
+        for (int col = 1; col < cols; ++col)
+        {
+            int f = cur[col];
+            int d_fver = std::abs(f - int(cur[col - 1]));
+            int d_fhor = std::abs(f - int(prev[col]));
+            int d_bver = std::abs(int(pad[col + 9]) - int(pad[col]));  // 9 * |Bver(col) - Bver(col - 1)|
+            int d_bhor = std::abs(int(down[col]) - int(up[col]));      // 9 * |Bhor(row) - Bhor(row - 1)|
+            s_fver += d_fver;
+            s_fhor += d_fhor;
+            s_vver += std::max(9 * d_fver - d_bver, 0);
+            s_vhor += std::max(9 * d_fhor - d_bhor, 0);
+        }
+        sums[0] += s_fver;
+        sums[1] += s_fhor;
+        sums[2] += s_vver;
+        sums[3] += s_vhor;
+    }
+}
@@ -9,22 +9,36 @@
     The difference is that this code re-implements most functions using OpenCV matrix operations instead of
     loops in the original code. This is neater and faster. You can set 'flag_matrix_method = false' to switch
     back to the original code.
+
+    By default a fused kernel is used instead ('flag_fused_kernel = true'). It computes the blurred differences,
+    the image differences and their sums in one pass over the grayscale image with integer arithmetic, so there
+    is no intermediate full-size image, and the only buffers are reused across input images.
+
+    For faster but approximate estimation (such as keyframe selection, where only the ranking of blurriness among
+    nearby frames matters), the fused kernel can run on a downsampled image ('setPyramidLevel()'), and/or only on
+    a grid of sampled tiles ('setTileSampling()'). Both are only used by the fused kernel.
 */
 
 #ifndef BLUR_ESTIMATION_H
 #define BLUR_ESTIMATION_H
 
 #include <iostream>
+#include <vector>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 class BlurEstimation
 {
 public:
+    BlurEstimation() {}
     BlurEstimation(const cv::Mat &input);
     ~BlurEstimation() {}
 
     float estimate();  // return measure of  bluriness of input, 0<=ret<=1 , higher ret means more bluriness
+    float estimate(const cv::Mat &input);  // same as above for a new input, reusing buffers of previous inputs
+
+    void setPyramidLevel(int level) { _pyramid_level = std::max(0, level); }
+    void setTileSampling(int grid_number, float tile_ratio);
 
 private:
     void blur();
@@ -33,13 +47,23 @@ private:
     void calV(const cv::Mat &m1, const cv::Mat &m2, cv::Mat &_Vver);
     float sumofCoefficient(cv::Mat &d_input);
     float estimationFinal(float s_Vver, float s_Vhor, float s_Fver, float s_Fhor);
+    float estimateFused();
+    void accumulateFusedSums(const cv::Mat &gray, long long sums[4]);
 
 private:
+    cv::Mat _gray;
     cv::Mat _F;
     cv::Mat _Bver;
     cv::Mat _Bhor;
+    std::vector<unsigned char> _row_padded;  // one row with reflected border, used in fused kernel
+    std::vector<cv::Mat> _pyramid;           // downsampled images, used in fused kernel
+
+    int _pyramid_level = 0;     // image is downsampled by 2^level before estimation
+    int _tile_grid_number = 0;  // image is divided into grid_number x grid_number cells, 0 to use the whole image
+    float _tile_ratio = 1.0f;   // width (height) of the tile in each cell over the width (height) of the cell
 
     bool flag_matrix_method = true; // faster and neater
+    bool flag_fused_kernel = true;  // fastest, and no intermediate images
 };
 
 #endif  // BLUR_ESTIMATION_H
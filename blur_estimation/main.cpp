@@ -2,14 +2,280 @@
 #include <string>
 #include "blur_estimation.h"
 #include "../common/tools.h"
+#include "../common/frame_bundle.h"
 #include <chrono>
-#include <map>
+#include <vector>
+#include <deque>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <gflags/gflags.h>
 
 using namespace std;
 
+DEFINE_int32(thread_number, 1, "number of threads computing blurriness. 1 to run in a single thread, 0 to use all cores");
+DEFINE_int32(io_thread_number, 1, "number of threads reading images ahead, only used when thread_number is not 1");
+DEFINE_int32(prefetch_frame_number, 16, "max number of decoded frames waiting to be processed");
+DEFINE_int32(pyramid_level, 0, "estimate on the image downsampled by 2^pyramid_level, 0 to use the full resolution");
+DEFINE_int32(tile_grid_number, 0, "estimate only on one tile in each cell of an NxN grid, 0 to use the whole image");
+DEFINE_double(tile_ratio, 0.5, "width (height) of each tile over the width (height) of its grid cell");
+DEFINE_bool(run_benchmark, false, "compare speed and ranking of the current mode with the full-resolution estimation");
+DEFINE_int32(benchmark_window, 5, "window size of keyframe selection in benchmark, same as rgbd_frame_gap of texture opt");
+DEFINE_string(frame_bundle, "", "read color images from this frame bundle file instead of image_path");
+
+string image_path, filename_prefix("frame-"), filename_suffix(".color.jpg");
+int digit_number = 6;
+FrameBundleReader frame_bundle;
+std::mutex print_mutex;  // serializes console output of concurrent threads
+
+string getImageFilename(int fidx)
+{
+    string str_fidx = std::to_string(fidx);
+    string str_fidx_padded = string(digit_number - str_fidx.length(), '0') + str_fidx;
+    return image_path + filename_prefix + str_fidx_padded + filename_suffix;
+}
+
+//! Read the color image of a frame from the frame bundle (if opened) or its image file. Thread-safe, and the error
+//! message is printed under 'print_mutex' so that output of concurrent I/O threads does not interleave.
+bool readFrameImage(int fidx, cv::Mat& img)
+{
+    if (frame_bundle.isOpen())
+    {
+        string error_msg;
+        if (frame_bundle.readColorImg(fidx, img, &error_msg))
+            return true;
+        std::lock_guard<std::mutex> lock(print_mutex);
+        PRINT_RED("%s", error_msg.c_str());
+        return false;
+    }
+    string filename = getImageFilename(fidx);
+    img = cv::imread(filename);
+    if (!img.data)
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        PRINT_RED("ERROR: cannot read image file %s", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+//! Set the downsampled / tiled mode by the command line flags.
+void configureEstimator(BlurEstimation& blur_est)
+{
+    blur_est.setPyramidLevel(FLAGS_pyramid_level);
+    blur_est.setTileSampling(FLAGS_tile_grid_number, float(FLAGS_tile_ratio));
+}
+
+//! Original single-thread mode: read and process frames one by one.
+bool runSingleThread(int start_fidx, int end_fidx, vector<float>& blurriness)
+{
+    float progress = 0.0;  // for printing a progress bar
+    int frame_num = end_fidx - start_fidx + 1;
+    const int kStep = (frame_num < 100) ? 1 : (frame_num / 100);
+    BlurEstimation blur_est;
+    configureEstimator(blur_est);
+    for (int fidx = start_fidx; fidx <= end_fidx; ++fidx)
+    {
+        int current_frame = fidx - start_fidx;
+        if (current_frame % kStep == 0 || fidx == end_fidx)
+        {
+            progress = (fidx == end_fidx) ? 1.0f : static_cast<float>(current_frame) / frame_num;
+            printProgressBar(progress);
+        }
+        cv::Mat img;
+        if (!readFrameImage(fidx, img))
+            return false;
+        blurriness[current_frame] = blur_est.estimate(img);
+    }
+    return true;
+}
+
+//! Thread-pool mode: I/O threads decode images ahead into a bounded queue, while worker threads take decoded
+//! images from the queue and estimate their blurriness. Each result is saved by its frame index, so the output
+//! order is the same as the single-thread mode.
+bool runThreadPool(int start_fidx, int end_fidx, int thread_num, int io_thread_num, vector<float>& blurriness)
+{
+    struct DecodedFrame
+    {
+        int frame_idx;  // index starting from 0 (the start frame)
+        cv::Mat img;
+    };
+    const int kFrameNum = end_fidx - start_fidx + 1;
+    const int kStep = (kFrameNum < 100) ? 1 : (kFrameNum / 100);
+    const size_t kMaxQueueSize = size_t(std::max(1, FLAGS_prefetch_frame_number));
+    std::deque<DecodedFrame> frame_queue;
+    std::mutex queue_mutex;
+    std::condition_variable cond_not_empty, cond_not_full;
+    std::atomic<int> next_frame(0), finished_frame_num(0);
+    std::atomic<bool> flag_error(false);
+    int running_io_thread_num = io_thread_num;
+
+    // Internal threads of OpenCV functions would compete with the workers
+    cv::setNumThreads(1);
+
+    auto reader = [&]() {
+        while (!flag_error)
+        {
+            int current_frame = next_frame++;
+            if (current_frame >= kFrameNum)
+                break;
+            DecodedFrame frame;
+            frame.frame_idx = current_frame;
+            if (!readFrameImage(start_fidx + current_frame, frame.img))
+            {
+                flag_error = true;
+                break;
+            }
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            cond_not_full.wait(lock, [&]() { return frame_queue.size() < kMaxQueueSize || flag_error; });
+            frame_queue.push_back(std::move(frame));
+            cond_not_empty.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        running_io_thread_num--;
+        cond_not_empty.notify_all();
+    };
+
+    auto worker = [&]() {
+        BlurEstimation blur_est;  // keep scratch buffers across frames
+        configureEstimator(blur_est);
+        while (true)
+        {
+            DecodedFrame frame;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                cond_not_empty.wait(lock, [&]() { return !frame_queue.empty() || running_io_thread_num == 0 || flag_error; });
+                if (frame_queue.empty() || flag_error)
+                {
+                    cond_not_full.notify_all();
+                    break;
+                }
+                frame = std::move(frame_queue.front());
+                frame_queue.pop_front();
+                cond_not_full.notify_one();
+            }
+            blurriness[frame.frame_idx] = blur_est.estimate(frame.img);
+            int finished = ++finished_frame_num;
+            if (finished % kStep == 0 || finished == kFrameNum)
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                printProgressBar((finished == kFrameNum) ? 1.0f : static_cast<float>(finished) / kFrameNum);
+            }
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int i = 0; i < io_thread_num; ++i)
+        threads.push_back(std::thread(reader));
+    for (int i = 0; i < thread_num; ++i)
+        threads.push_back(std::thread(worker));
+    for (std::thread& t : threads)
+        t.join();
+    return !flag_error;
+}
+
+//! Ranks of values (starting from 0), tied values get their average rank.
+vector<double> computeRanks(const vector<float>& values)
+{
+    vector<int> order(values.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = int(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return values[a] < values[b]; });
+    vector<double> ranks(values.size());
+    for (size_t i = 0; i < order.size();)
+    {
+        size_t j = i;
+        while (j + 1 < order.size() && values[order[j + 1]] == values[order[i]])
+            j++;
+        for (size_t k = i; k <= j; ++k)
+            ranks[order[k]] = (i + j) / 2.0;
+        i = j + 1;
+    }
+    return ranks;
+}
+
+//! Spearman rank correlation of two sequences of the same size, i.e. Pearson correlation of their ranks.
+double computeSpearmanCorrelation(const vector<float>& a, const vector<float>& b)
+{
+    vector<double> rank_a = computeRanks(a), rank_b = computeRanks(b);
+    double n = double(a.size()), mean = (n - 1) / 2.0;
+    double cov = 0, var_a = 0, var_b = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        cov += (rank_a[i] - mean) * (rank_b[i] - mean);
+        var_a += (rank_a[i] - mean) * (rank_a[i] - mean);
+        var_b += (rank_b[i] - mean) * (rank_b[i] - mean);
+    }
+    if (var_a == 0 || var_b == 0)
+        return (var_a == var_b) ? 1.0 : 0.0;
+    return cov / std::sqrt(var_a * var_b);
+}
+
+//! Benchmark mode: estimate each frame with both the full-resolution method and the current (downsampled / tiled)
+//! mode in a single thread, then report the speedup and how well the current mode keeps the blurriness ranking,
+//! including the keyframes (the sharpest frame in each window, same as 'readRGBDFrames()' of texture opt).
+//! Image decoding is excluded from the timing. Results of the current mode are saved in 'blurriness'.
+bool runBenchmark(int start_fidx, int end_fidx, vector<float>& blurriness)
+{
+    const int kFrameNum = end_fidx - start_fidx + 1;
+    const int kStep = (kFrameNum < 100) ? 1 : (kFrameNum / 100);
+    vector<float> blurriness_full(kFrameNum, 0);
+    BlurEstimation blur_est_full, blur_est;
+    configureEstimator(blur_est);
+    double time_full = 0, time_current = 0;  // in ms
+    for (int i = 0; i < kFrameNum; ++i)
+    {
+        if (i % kStep == 0 || i == kFrameNum - 1)
+            printProgressBar((i == kFrameNum - 1) ? 1.0f : static_cast<float>(i) / kFrameNum);
+        cv::Mat img;
+        if (!readFrameImage(start_fidx + i, img))
+            return false;
+        auto t0 = std::chrono::steady_clock::now();
+        blurriness_full[i] = blur_est_full.estimate(img);
+        auto t1 = std::chrono::steady_clock::now();
+        blurriness[i] = blur_est.estimate(img);
+        auto t2 = std::chrono::steady_clock::now();
+        time_full += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        time_current += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
+    if (kFrameNum <= 0)
+        return true;
+
+    // Keyframe is the frame with the smallest blurriness in each window
+    const int kWindow = std::max(1, FLAGS_benchmark_window);
+    int window_num = 0, same_keyframe_num = 0;
+    double sum_window_correlation = 0;
+    for (int begin = 0; begin < kFrameNum; begin += kWindow)
+    {
+        int end = std::min(begin + kWindow, kFrameNum);
+        auto it_full = std::min_element(blurriness_full.begin() + begin, blurriness_full.begin() + end);
+        auto it_current = std::min_element(blurriness.begin() + begin, blurriness.begin() + end);
+        if (it_full - blurriness_full.begin() == it_current - blurriness.begin())
+            same_keyframe_num++;
+        sum_window_correlation +=
+            computeSpearmanCorrelation(vector<float>(blurriness_full.begin() + begin, blurriness_full.begin() + end),
+                                       vector<float>(blurriness.begin() + begin, blurriness.begin() + end));
+        window_num++;
+    }
+    PRINT_GREEN("Benchmark of pyramid level %d, tile grid %d, tile ratio %.2f on %d frames:", FLAGS_pyramid_level,
+                FLAGS_tile_grid_number, FLAGS_tile_ratio, kFrameNum);
+    cout << "  Full resolution: " << time_full / kFrameNum << " ms/frame, current mode: " << time_current / kFrameNum
+         << " ms/frame, speedup: " << time_full / std::max(time_current, 1e-6) << endl;
+    cout << "  Spearman rank correlation: " << computeSpearmanCorrelation(blurriness_full, blurriness)
+         << " (all frames), " << sum_window_correlation / window_num << " (mean of windows of " << kWindow << " frames)"
+         << endl;
+    cout << "  Same keyframe in " << same_keyframe_num << " / " << window_num << " windows ("
+         << 100.0 * same_keyframe_num / window_num << "%)" << endl;
+    return true;
+}
+
 int main(int argc, char** argv)
 {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
     if (argc != 5 && argc != 8)
     {
         PRINT_RED(
@@ -20,15 +286,20 @@ int main(int argc, char** argv)
                 "+ '0001' (digit number is 4 here) + 'filename_suffix'. Index digit number 0 means no padded zeros"
                 " before frame index."
              << endl;
+        cout << "Use --thread_number=N to set the number of worker threads (1 by default to read and process frames one "
+                "by one, 0 for all cores)."
+             << endl;
+        cout << "Use --pyramid_level=L and/or --tile_grid_number=N --tile_ratio=R for faster approximate estimation, and "
+                "--run_benchmark to compare it with the full-resolution estimation."
+             << endl;
+        cout << "Use --frame_bundle=FILE to read color images from a frame bundle made by 'frame_bundle'." << endl;
         return -1;
     }
-    string image_path(argv[1]);
+    image_path = string(argv[1]);
     if (image_path.back() != '/' && image_path.back() != '\\')
         image_path += "/";
 
     int start_fidx = atoi(argv[2]), end_fidx = atoi(argv[3]);
-    string filename_prefix("frame-"), filename_suffix(".color.jpg");
-    int digit_number = 6;
     string output_fname(argv[4]);
     if (argc == 8)
     {
@@ -36,43 +307,34 @@ int main(int argc, char** argv)
         filename_suffix = string(argv[6]);
         digit_number = atoi(argv[7]);
     }
+    if (!FLAGS_frame_bundle.empty() && !frame_bundle.open(FLAGS_frame_bundle))
+        return -1;
+    int thread_num = FLAGS_thread_number;
+    if (thread_num <= 0)
+        thread_num = std::max(1, int(std::thread::hardware_concurrency()));
+    int io_thread_num = std::max(1, FLAGS_io_thread_number);
 
     PRINT_GREEN("Computing image blurriness for frames ... ");
-    float progress = 0.0;  // for printing a progress bar
-    int frame_num = end_fidx - start_fidx + 1;
-    const int kStep = (frame_num < 100) ? 1 : (frame_num / 100);
     auto start = std::chrono::steady_clock::now();
-    map<int, float> blurriness;
-    for (int fidx = start_fidx; fidx <= end_fidx; ++fidx)
-    {
-        int current_frame = fidx - start_fidx;
-        if (current_frame % kStep == 0 || fidx == end_fidx)
-        {
-            progress = (fidx == end_fidx) ? 1.0f : static_cast<float>(current_frame) / frame_num;
-            printProgressBar(progress);
-        }
-
-        string str_fidx = std::to_string(fidx);
-        string str_fidx_padded = string(digit_number - str_fidx.length(), '0') + str_fidx;
-        string filename = image_path + filename_prefix + str_fidx_padded + filename_suffix;
-        cv::Mat img = cv::imread(filename);
-        if (!img.data)
-        {
-            PRINT_RED("ERROR: cannot read image file %s", filename.c_str());
-            return -1;
-        }
-        BlurEstimation blur_est(img);
-        blurriness[fidx] = blur_est.estimate();
-    }
+    vector<float> blurriness(std::max(0, end_fidx - start_fidx + 1), 0);
+    bool flag_success = false;
+    if (FLAGS_run_benchmark)
+        flag_success = runBenchmark(start_fidx, end_fidx, blurriness);
+    else if (thread_num == 1)
+        flag_success = runSingleThread(start_fidx, end_fidx, blurriness);
+    else
+        flag_success = runThreadPool(start_fidx, end_fidx, thread_num, io_thread_num, blurriness);
+    if (!flag_success)
+        return -1;
     auto end = std::chrono::steady_clock::now();
     double delta = std::chrono::duration_cast<chrono::milliseconds>(end - start).count();
     PRINT_RED("Time: %f ms", delta);
 
     PRINT_GREEN("Save image blurriness data into %s", output_fname.c_str());
     std::ofstream writeout(output_fname, std::ios::trunc);
-    for (auto it : blurriness)
+    for (size_t i = 0; i < blurriness.size(); ++i)
     {
-        writeout << it.first << " " << it.second << std::endl;
+        writeout << start_fidx + int(i) << " " << blurriness[i] << std::endl;
     }
     writeout.close();
 
@@ -26,6 +26,17 @@ make
 cp mesh_visibility ../../bin
 cd ../..
 
+# RGB-D frame bundle
+cd frame_bundle
+if [ ! -d "build" ]; then
+	mkdir build
+fi
+cd build
+cmake ..
+make
+cp frame_bundle ../../bin
+cd ../..
+
 # Image Blur Estimation
 cd blur_estimation
 if [ ! -d "build" ]; then
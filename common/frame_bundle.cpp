@@ -0,0 +1,387 @@
+#include "frame_bundle.h"
+#include <string.h>
+#include <opencv2/highgui/highgui.hpp>
+#include "tools.h"
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kBundleMagic[8] = {'R', 'G', 'B', 'D', 'B', 'N', 'D', 'L'};
+static const uint32_t kBundleVersion = 1;
+
+/************************************************************************/
+/* Depth codec
+ */
+/************************************************************************/
+
+//! Losslessly compress a 16-bit depth image by left-pixel prediction and zigzag varint of the differences.
+void encodeDepthImg(const cv::Mat& depth_img, std::vector<unsigned char>& bytes)
+{
+    bytes.clear();
+    bytes.reserve(depth_img.total() + depth_img.rows);
+    int pred = 0;
+    for (int y = 0; y < depth_img.rows; ++y)
+    {
+        const unsigned short* row = depth_img.ptr<unsigned short>(y);
+        int row_first = row[0];
+        for (int x = 0; x < depth_img.cols; ++x)
+        {
+            int diff = int(row[x]) - pred;
+            uint32_t zigzag = (uint32_t(diff) << 1) ^ uint32_t(diff >> 31);
+            while (zigzag >= 0x80)
+            {
+                bytes.push_back((unsigned char)(zigzag | 0x80));
+                zigzag >>= 7;
+            }
+            bytes.push_back((unsigned char)zigzag);
+            pred = row[x];
+        }
+        pred = row_first;  // first pixel of next row is predicted by the first pixel of this row
+    }
+}
+
+//! Decode a depth image compressed by 'encodeDepthImg()'. Return false if the data is corrupted.
+bool decodeDepthImg(const unsigned char* bytes, size_t size, int width, int height, cv::Mat& depth_img)
+{
+    depth_img.create(height, width, CV_16UC1);
+    const unsigned char* end = bytes + size;
+    int pred = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        unsigned short* row = depth_img.ptr<unsigned short>(y);
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t zigzag = 0;
+            int shift = 0;
+            while (true)
+            {
+                if (bytes == end || shift > 28)
+                    return false;
+                unsigned char b = *bytes++;
+                zigzag |= uint32_t(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    break;
+                shift += 7;
+            }
+            int diff = int(zigzag >> 1) ^ -int(zigzag & 1);
+            pred += diff;
+            row[x] = (unsigned short)pred;
+        }
+        pred = row[0];
+    }
+    return bytes == end;
+}
+
+/************************************************************************/
+/* Writer
+ */
+/************************************************************************/
+
+FrameBundleWriter::FrameBundleWriter() : fout_(NULL), color_codec_(kColorCodecEncoded), file_size_(0) {}
+
+FrameBundleWriter::~FrameBundleWriter()
+{
+    if (fout_)
+        close();
+}
+
+bool FrameBundleWriter::open(const std::string& filename, int color_codec)
+{
+    fout_ = fopen(filename.c_str(), "wb");
+    if (fout_ == NULL)
+    {
+        PRINT_RED("ERROR: cannot create frame bundle file %s", filename.c_str());
+        return false;
+    }
+    color_codec_ = color_codec;
+    entries_.clear();
+    // Header is written again when closing the file
+    FrameBundleHeader header;
+    memset(&header, 0, sizeof(header));
+    uint64_t offset = 0;
+    file_size_ = 0;
+    return writeData(&header, sizeof(header), offset);
+}
+
+bool FrameBundleWriter::writeData(const void* data, size_t size, uint64_t& offset)
+{
+    offset = file_size_;
+    if (size > 0 && fwrite(data, 1, size, fout_) != size)
+    {
+        PRINT_RED("ERROR: failed to write frame bundle file.");
+        return false;
+    }
+    file_size_ += size;
+    return true;
+}
+
+//! Add a frame into the bundle. 'encoded_color' is the original color image file content, which is
+//! saved instead of 'color_img' in encoded color codec. 'pose' and 'visible_vertices' can be null.
+bool FrameBundleWriter::addFrame(int frame_idx, const cv::Mat& color_img, const std::vector<unsigned char>& encoded_color,
+    const cv::Mat& depth_img, const double* pose, const std::vector<int>* visible_vertices)
+{
+    if (fout_ == NULL || color_img.type() != CV_8UC3 || depth_img.type() != CV_16UC1)
+        return false;
+    FrameBundleEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.frame_idx = frame_idx;
+    entry.color_width = color_img.cols;
+    entry.color_height = color_img.rows;
+    entry.depth_width = depth_img.cols;
+    entry.depth_height = depth_img.rows;
+
+    // Color image
+    if (color_codec_ == kColorCodecRaw)
+    {
+        entry.color_size = color_img.total() * 3;
+        for (int y = 0; y < color_img.rows; ++y)
+        {
+            uint64_t offset = 0;
+            if (!writeData(color_img.ptr<unsigned char>(y), color_img.cols * 3, offset))
+                return false;
+            if (y == 0)
+                entry.color_offset = offset;
+        }
+    }
+    else
+    {
+        entry.color_size = encoded_color.size();
+        if (!writeData(encoded_color.data(), encoded_color.size(), entry.color_offset))
+            return false;
+    }
+
+    // Depth image
+    std::vector<unsigned char> depth_bytes;
+    encodeDepthImg(depth_img, depth_bytes);
+    entry.depth_size = depth_bytes.size();
+    if (!writeData(depth_bytes.data(), depth_bytes.size(), entry.depth_offset))
+        return false;
+
+    // Visibility and pose
+    if (visible_vertices)
+    {
+        entry.flags |= FrameBundleEntry::kHasVisibility;
+        entry.visibility_size = visible_vertices->size() * sizeof(int32_t);
+        if (!writeData(visible_vertices->data(), entry.visibility_size, entry.visibility_offset))
+            return false;
+    }
+    if (pose)
+    {
+        entry.flags |= FrameBundleEntry::kHasPose;
+        memcpy(entry.pose, pose, sizeof(entry.pose));
+    }
+    entries_.push_back(entry);
+    return true;
+}
+
+//! Write the index and header, then close the file.
+bool FrameBundleWriter::close()
+{
+    if (fout_ == NULL)
+        return false;
+    FrameBundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+    header.version = kBundleVersion;
+    header.color_codec = color_codec_;
+    header.frame_num = entries_.size();
+    bool flag_success = writeData(entries_.data(), entries_.size() * sizeof(FrameBundleEntry), header.index_offset);
+    flag_success = flag_success && fseek(fout_, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fout_) == 1;
+    flag_success = (fclose(fout_) == 0) && flag_success;
+    fout_ = NULL;
+    if (!flag_success)
+        PRINT_RED("ERROR: failed to write frame bundle file.");
+    return flag_success;
+}
+
+/************************************************************************/
+/* Reader
+ */
+/************************************************************************/
+
+FrameBundleReader::FrameBundleReader() : data_(nullptr), data_size_(0), color_codec_(kColorCodecEncoded) {}
+
+FrameBundleReader::~FrameBundleReader()
+{
+    close();
+}
+
+bool FrameBundleReader::open(const std::string& filename)
+{
+    close();
+#ifdef _WIN32
+    std::ifstream readin(filename, std::ios::binary);
+    if (readin.fail())
+    {
+        PRINT_RED("ERROR: cannot open frame bundle file %s", filename.c_str());
+        return false;
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(readin), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    data_size_ = buffer_.size();
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        PRINT_RED("ERROR: cannot open frame bundle file %s", filename.c_str());
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    void* addr = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);  // the mapping is still valid after closing the file
+    if (addr == MAP_FAILED)
+    {
+        PRINT_RED("ERROR: cannot map frame bundle file %s", filename.c_str());
+        return false;
+    }
+    data_ = static_cast<const unsigned char*>(addr);
+    data_size_ = size_t(st.st_size);
+#endif
+
+    // Check header and read index
+    FrameBundleHeader header;
+    if (data_size_ < sizeof(header))
+    {
+        PRINT_RED("ERROR: frame bundle file %s is corrupted.", filename.c_str());
+        close();
+        return false;
+    }
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0 || header.version != kBundleVersion ||
+        header.index_offset + header.frame_num * sizeof(FrameBundleEntry) > data_size_)
+    {
+        PRINT_RED("ERROR: %s is not a valid frame bundle file.", filename.c_str());
+        close();
+        return false;
+    }
+    color_codec_ = int(header.color_codec);
+    entries_.resize(header.frame_num);
+    if (header.frame_num > 0)
+        memcpy(entries_.data(), data_ + header.index_offset, header.frame_num * sizeof(FrameBundleEntry));
+    for (size_t i = 0; i < entries_.size(); ++i)
+    {
+        const FrameBundleEntry& entry = entries_[i];
+        if (entry.color_offset + entry.color_size > data_size_ || entry.depth_offset + entry.depth_size > data_size_ ||
+            entry.visibility_offset + entry.visibility_size > data_size_)
+        {
+            PRINT_RED("ERROR: frame %d in frame bundle file %s is corrupted.", entry.frame_idx, filename.c_str());
+            close();
+            return false;
+        }
+        frame_positions_[entry.frame_idx] = int(i);
+    }
+    return true;
+}
+
+void FrameBundleReader::close()
+{
+    if (data_ == nullptr)
+        return;
+#ifdef _WIN32
+    buffer_.clear();
+    buffer_.shrink_to_fit();
+#else
+    munmap(const_cast<unsigned char*>(data_), data_size_);
+#endif
+    data_ = nullptr;
+    data_size_ = 0;
+    entries_.clear();
+    frame_positions_.clear();
+}
+
+//! Report an error of a read function: saved into 'error_msg' if it's not null (for callers which serialize output
+//! of their threads), otherwise printed.
+static void reportReadError(std::string* error_msg, int frame_idx, const char* what)
+{
+    std::string msg = "ERROR: " + std::string(what) + " of frame " + std::to_string(frame_idx) + " in the frame bundle.";
+    if (error_msg != nullptr)
+        *error_msg = msg;
+    else
+        PRINT_RED("%s", msg.c_str());
+}
+
+const FrameBundleEntry* FrameBundleReader::findEntry(int frame_idx, std::string* error_msg) const
+{
+    auto it = frame_positions_.find(frame_idx);
+    if (it == frame_positions_.end())
+    {
+        reportReadError(error_msg, frame_idx, "no data");
+        return nullptr;
+    }
+    return &entries_[it->second];
+}
+
+bool FrameBundleReader::hasVisibility(int frame_idx) const
+{
+    auto it = frame_positions_.find(frame_idx);
+    return it != frame_positions_.end() && (entries_[it->second].flags & FrameBundleEntry::kHasVisibility);
+}
+
+bool FrameBundleReader::readColorImg(int frame_idx, cv::Mat& img, std::string* error_msg) const
+{
+    const FrameBundleEntry* entry = findEntry(frame_idx, error_msg);
+    if (entry == nullptr)
+        return false;
+    const unsigned char* bytes = data_ + entry->color_offset;
+    if (color_codec_ == kColorCodecRaw)
+        img = cv::Mat(entry->color_height, entry->color_width, CV_8UC3, const_cast<unsigned char*>(bytes));
+    else
+        img = cv::imdecode(cv::Mat(1, int(entry->color_size), CV_8UC1, const_cast<unsigned char*>(bytes)),
+            CV_LOAD_IMAGE_COLOR);
+    if (img.empty() || img.cols != int(entry->color_width) || img.rows != int(entry->color_height))
+    {
+        reportReadError(error_msg, frame_idx, "cannot decode color image");
+        return false;
+    }
+    return true;
+}
+
+bool FrameBundleReader::readDepthImg(int frame_idx, cv::Mat& img, std::string* error_msg) const
+{
+    const FrameBundleEntry* entry = findEntry(frame_idx, error_msg);
+    if (entry == nullptr)
+        return false;
+    if (!decodeDepthImg(data_ + entry->depth_offset, entry->depth_size, entry->depth_width, entry->depth_height, img))
+    {
+        reportReadError(error_msg, frame_idx, "cannot decode depth image");
+        return false;
+    }
+    return true;
+}
+
+bool FrameBundleReader::readPose(int frame_idx, double pose[16], std::string* error_msg) const
+{
+    const FrameBundleEntry* entry = findEntry(frame_idx, error_msg);
+    if (entry == nullptr)
+        return false;
+    if (!(entry->flags & FrameBundleEntry::kHasPose))
+    {
+        reportReadError(error_msg, frame_idx, "no camera pose");
+        return false;
+    }
+    memcpy(pose, entry->pose, sizeof(entry->pose));
+    return true;
+}
+
+bool FrameBundleReader::readVisibility(int frame_idx, std::vector<int>& visible_vertices, std::string* error_msg) const
+{
+    const FrameBundleEntry* entry = findEntry(frame_idx, error_msg);
+    if (entry == nullptr)
+        return false;
+    if (!(entry->flags & FrameBundleEntry::kHasVisibility))
+    {
+        reportReadError(error_msg, frame_idx, "no visibility");
+        return false;
+    }
+    visible_vertices.resize(entry->visibility_size / sizeof(int32_t));
+    if (!visible_vertices.empty())
+        memcpy(visible_vertices.data(), data_ + entry->visibility_offset, entry->visibility_size);
+    return true;
+}
@@ -0,0 +1,113 @@
+/*!
+    Binary bundle of an RGB-D sequence, so that programs read one indexed file instead of
+    separate color, depth, pose and visibility files for each frame.
+
+    File layout (little-endian):
+    - header ('FrameBundleHeader');
+    - data of each frame: color image, depth image and visible vertex indices;
+    - index ('FrameBundleEntry' for each frame), at 'index_offset' in the header.
+
+    Color images are either kept as their original encoded file (such as jpg/png), or saved as raw
+    BGR pixels which need no decoding. Depth images are losslessly compressed: each pixel is predicted
+    by its left pixel (the first pixel by the first pixel of last row), and the difference is saved as
+    a zigzag varint, which is mostly 1 byte for continuous depth.
+
+    The reader maps the whole file into memory, so frames can be read in any order by multiple threads.
+*/
+
+#ifndef FRAME_BUNDLE_H
+#define FRAME_BUNDLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <opencv2/core/core.hpp>
+
+enum FrameBundleColorCodec
+{
+    kColorCodecEncoded = 0,  // original encoded file content
+    kColorCodecRaw = 1,      // raw BGR pixels
+};
+
+struct FrameBundleHeader
+{
+    char magic[8];  // "RGBDBNDL"
+    uint32_t version;
+    uint32_t color_codec;
+    uint64_t frame_num;
+    uint64_t index_offset;
+};
+
+struct FrameBundleEntry
+{
+    enum Flags
+    {
+        kHasPose = 1,
+        kHasVisibility = 2,
+    };
+    int32_t frame_idx;  // frame index in the original sequence
+    uint32_t flags;
+    uint32_t color_width, color_height, depth_width, depth_height;
+    uint64_t color_offset, color_size;  // in bytes
+    uint64_t depth_offset, depth_size;
+    uint64_t visibility_offset, visibility_size;
+    double pose[16];  // row-major 4x4 camera pose
+};
+
+class FrameBundleWriter
+{
+public:
+    FrameBundleWriter();
+    ~FrameBundleWriter();
+    bool open(const std::string& filename, int color_codec);
+    bool addFrame(int frame_idx, const cv::Mat& color_img, const std::vector<unsigned char>& encoded_color,
+        const cv::Mat& depth_img, const double* pose, const std::vector<int>* visible_vertices);
+    bool close();
+
+private:
+    bool writeData(const void* data, size_t size, uint64_t& offset);
+
+    FILE* fout_;
+    int color_codec_;
+    uint64_t file_size_;
+    std::vector<FrameBundleEntry> entries_;
+};
+
+class FrameBundleReader
+{
+public:
+    FrameBundleReader();
+    ~FrameBundleReader();
+    bool open(const std::string& filename);
+    void close();
+    bool isOpen() const { return data_ != nullptr; }
+    int getFrameNumber() const { return int(entries_.size()); }
+    bool hasFrame(int frame_idx) const { return frame_positions_.count(frame_idx) > 0; }
+    bool hasVisibility(int frame_idx) const;
+    // All functions below are thread-safe. 'frame_idx' is the frame index in the original sequence.
+    // Errors are printed, or saved into 'error_msg' if it's given, so that callers can serialize output of threads.
+    // NOTE: color images in raw codec point into the read-only mapped file. Clone them before modifying.
+    bool readColorImg(int frame_idx, cv::Mat& img, std::string* error_msg = nullptr) const;
+    bool readDepthImg(int frame_idx, cv::Mat& img, std::string* error_msg = nullptr) const;
+    bool readPose(int frame_idx, double pose[16], std::string* error_msg = nullptr) const;
+    bool readVisibility(int frame_idx, std::vector<int>& visible_vertices, std::string* error_msg = nullptr) const;
+
+private:
+    const FrameBundleEntry* findEntry(int frame_idx, std::string* error_msg) const;
+
+    const unsigned char* data_;  // whole file content
+    size_t data_size_;
+    int color_codec_;
+    std::vector<FrameBundleEntry> entries_;
+    std::unordered_map<int, int> frame_positions_;  // frame index -> position in 'entries_'
+#ifdef _WIN32
+    std::vector<unsigned char> buffer_;  // no mmap, the whole file is read into memory
+#endif
+};
+
+void encodeDepthImg(const cv::Mat& depth_img, std::vector<unsigned char>& bytes);
+bool decodeDepthImg(const unsigned char* bytes, size_t size, int width, int height, cv::Mat& depth_img);
+
+#endif  // FRAME_BUNDLE_H
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <iterator>
+#include <opencv2/highgui/highgui.hpp>
+#include <gflags/gflags.h>
+#include "../common/tools.h"
+#include "../common/frame_bundle.h"
+
+using namespace std;
+
+DEFINE_string(color_codec, "encoded", "'encoded' to keep the original color image files, 'raw' to save decoded pixels");
+DEFINE_string(color_suffix, ".color.jpg", "color image filename suffix, such as '.color.png' for ICL-NUIM data");
+
+string getFrameFilename(const string& path, int fidx)
+{
+    string str_fidx = std::to_string(fidx);
+    return path + "frame-" + string(6 - std::min(6, int(str_fidx.length())), '0') + str_fidx;
+}
+
+bool readFileContent(const string& filename, vector<unsigned char>& content)
+{
+    ifstream readin(filename, ios::binary);
+    if (readin.fail())
+        return false;
+    content.assign(std::istreambuf_iterator<char>(readin), std::istreambuf_iterator<char>());
+    return true;
+}
+
+//! Same format as the pose files read by 'mesh_texture_opt': a 4x4 matrix.
+bool readPoseFile(const string& filename, double pose[16])
+{
+    ifstream readin(filename, ios::in);
+    if (readin.fail())
+        return false;
+    for (int i = 0; i < 16; ++i)
+        readin >> pose[i];
+    return !readin.fail();
+}
+
+//! Same format as the visibility files written by 'mesh_visibility': vertex number and then vertex indices.
+bool readVisibilityFile(const string& filename, vector<int>& visible_vertices)
+{
+    FILE* fin = fopen(filename.c_str(), "rb");
+    if (fin == NULL)
+        return false;
+    int num = -1;
+    bool flag_success = fread(&num, sizeof(int), 1, fin) == 1;
+    visible_vertices.assign(std::max(num, 0), 0);
+    if (flag_success && num > 0)
+        flag_success = fread(&visible_vertices[0], sizeof(int), num, fin) == size_t(num);
+    fclose(fin);
+    return flag_success;
+}
+
+int main(int argc, char** argv)
+{
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 5 && argc != 6)
+    {
+        PRINT_RED("Usage: frame_bundle RGBD_path start_frame end_frame output_bundle_file [visibility_path]");
+        cout << "Pack color, depth and pose files (like 'frame-000001.color.jpg', 'frame-000001.depth.png' and "
+                "'frame-000001.pose.txt') of an RGB-D sequence into one frame bundle file. Visibility files from "
+                "'mesh_visibility' are also packed if visibility_path is given."
+             << endl;
+        cout << "Use --color_suffix to set the color image suffix (such as '.color.png'), and --color_codec=raw to save "
+                "decoded color pixels, which are larger but need no decoding when read."
+             << endl;
+        return -1;
+    }
+    string rgbd_path(argv[1]);
+    if (rgbd_path.back() != '/' && rgbd_path.back() != '\\')
+        rgbd_path += "/";
+    int start_fidx = atoi(argv[2]), end_fidx = atoi(argv[3]);
+    string output_fname(argv[4]);
+    string visibility_path;
+    if (argc == 6)
+    {
+        visibility_path = string(argv[5]);
+        if (visibility_path.back() != '/' && visibility_path.back() != '\\')
+            visibility_path += "/";
+    }
+    int color_codec = kColorCodecEncoded;
+    if (FLAGS_color_codec == "raw")
+        color_codec = kColorCodecRaw;
+    else if (FLAGS_color_codec != "encoded")
+    {
+        PRINT_RED("ERROR: unknown color codec %s", FLAGS_color_codec.c_str());
+        return -1;
+    }
+
+    PRINT_GREEN("Packing frames %d to %d into %s ...", start_fidx, end_fidx, output_fname.c_str());
+    auto start = std::chrono::steady_clock::now();
+    FrameBundleWriter writer;
+    if (!writer.open(output_fname, color_codec))
+        return -1;
+    const int kFrameNum = end_fidx - start_fidx + 1;
+    const int kStep = (kFrameNum < 100) ? 1 : (kFrameNum / 100);
+    int pose_num = 0, visibility_num = 0;
+    for (int fidx = start_fidx; fidx <= end_fidx; ++fidx)
+    {
+        int current_frame = fidx - start_fidx;
+        if (current_frame % kStep == 0 || fidx == end_fidx)
+            printProgressBar((fidx == end_fidx) ? 1.0f : static_cast<float>(current_frame) / kFrameNum);
+        string frame_fname = getFrameFilename(rgbd_path, fidx);
+        string color_fname = frame_fname + FLAGS_color_suffix, depth_fname = frame_fname + ".depth.png";
+        vector<unsigned char> encoded_color;
+        if (!readFileContent(color_fname, encoded_color))
+        {
+            PRINT_RED("ERROR: cannot read color image %s", color_fname.c_str());
+            return -1;
+        }
+        // Decode anyway to check the image and get its size
+        cv::Mat color_img = cv::imdecode(encoded_color, CV_LOAD_IMAGE_COLOR);
+        cv::Mat depth_img = cv::imread(depth_fname, CV_LOAD_IMAGE_ANYDEPTH);
+        if (color_img.empty() || color_img.depth() != CV_8U)
+        {
+            PRINT_RED("ERROR: cannot read color image %s", color_fname.c_str());
+            return -1;
+        }
+        if (depth_img.empty() || depth_img.type() != CV_16UC1)
+        {
+            PRINT_RED("ERROR: cannot read depth image %s", depth_fname.c_str());
+            return -1;
+        }
+        // Poses and visibility are optional, e.g. visibility may be computed after packing
+        double pose[16];
+        bool has_pose = readPoseFile(frame_fname + ".pose.txt", pose);
+        vector<int> visible_vertices;
+        bool has_visibility = !visibility_path.empty() &&
+                              readVisibilityFile(getFrameFilename(visibility_path, fidx) + ".visibility.txt", visible_vertices);
+        pose_num += has_pose;
+        visibility_num += has_visibility;
+        if (!writer.addFrame(fidx, color_img, encoded_color, depth_img, has_pose ? pose : nullptr,
+                             has_visibility ? &visible_vertices : nullptr))
+            return -1;
+    }
+    if (!writer.close())
+        return -1;
+    auto end = std::chrono::steady_clock::now();
+    double delta = std::chrono::duration_cast<chrono::milliseconds>(end - start).count();
+    PRINT_RED("Time: %f ms", delta);
+    cout << "#Frames: " << std::max(kFrameNum, 0) << ", with pose: " << pose_num << ", with visibility: " << visibility_num
+         << endl;
+    return 0;
+}
@@ -2,7 +2,12 @@
 #include <Eigen/SparseCholesky>
 #include <queue>
 #include <fstream>
+#include <atomic>
+#include <climits>
 #include "../common/tools.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // DEFINE_string(frame_filename_suffix, std::string(".color.png"), "");
 DEFINE_int32(rgbd_frame_gap, 5, "select 1 keyframe from every 'rgbd_frame_gap' frames");
@@ -11,17 +16,38 @@ DEFINE_int32(image_border_width, 5, "");
 DEFINE_int32(global_opt_loop_number, 10, "0 to skip the entire optimization");
 DEFINE_int32(pose_opt_loop_number, 5, "0 to completely skip pose optimization");
 DEFINE_int32(plane_opt_loop_number, 2, "0 to completely skip plane optimization");
+DEFINE_bool(joint_pose_plane_opt, false, "optimize poses and planes jointly by Levenberg-Marquardt instead of alternately");
+DEFINE_string(robust_loss, "squared", "loss of color differences in plane and pose opt: 'squared', 'huber' or 'cauchy'");
+DEFINE_double(robust_loss_scale, 0.05, "residual scale of huber/cauchy loss, in gray color in [0, 1]");
+DEFINE_int32(joint_opt_loop_number, 5, "iterations (texel passes) of joint pose and plane opt in each global opt loop");
+DEFINE_int32(joint_opt_dense_frame_number, 200, "solve the reduced pose system of joint opt by dense LLT if there are "
+                                                "fewer frames than this, otherwise by sparse LDLT");
 
 DEFINE_double(closest_pose_translation, 0.05, "in meter");
 DEFINE_double(closest_pose_rotation_angle, 0.09, "in radians. About root of squared sum of 3 degree per axis");
 DEFINE_double(patch_boundingbox_borderwidth, 0.02, "in meter. Pad each patch rectangle with a small width on the border.");
+DEFINE_bool(allow_patch_rotation, false, "allow rotating patches by 90 degrees to pack texture images more densely");
 DEFINE_double(
     unit_meter_resolution, 300, "number of pixels in 1cm in the output texture image. Must >=300 according to experiments.");
 DEFINE_bool(use_noisy_poses, false, "for debug");
 DEFINE_bool(use_opt_geometry, true, "false: use original mesh; true: optimized mesh");
 DEFINE_bool(run_opt_geometry, true, "false to skip the geometry optimization");
-
-RGBDMeshOpt::RGBDMeshOpt() {}
+DEFINE_int32(geometry_cg_vertex_number, 0, "solve mesh components with at least this many vertices by matrix-free "
+                                           "conjugate gradient in geometry opt, 0 to always use Cholesky factorization");
+DEFINE_int32(geometry_cg_max_iteration, 1000, "max iterations of conjugate gradient in geometry opt");
+DEFINE_double(geometry_cg_tolerance, 1e-6, "conjugate gradient stops if residual norm < tolerance * norm of JTr");
+DEFINE_int32(pyramid_level_number, 1, "image pyramid levels in plane and pose opt, 1 to only use full resolution");
+DEFINE_int32(pyramid_level_loop_number, 2, "number of global opt loops at each coarse pyramid level");
+DEFINE_string(frame_bundle, "", "read RGB-D frames (and visibility if bundled) from this frame bundle file");
+DEFINE_int32(frame_cache_mb, 0, "memory budget of color images in MB, 0 to keep all color images in memory");
+DEFINE_int32(texel_view_number, 0, "compute texel color from the best N frames by blurriness, viewing angle and "
+                                   "distance. 0 to average all visible frames");
+DEFINE_bool(use_visibility_cache, true, "cache visible frames of each texel instead of testing depth in every loop");
+DEFINE_double(visibility_cache_translation, 0.01, "in meter. Rebuild cache of a frame/plane moving more than this");
+DEFINE_double(visibility_cache_rotation_angle, 0.01, "in radians. Rebuild cache of a frame/plane rotating more than this");
+DEFINE_double(visibility_cache_pixel_shift, 1.0, "in pixel. Test depth again if a projection moves more than this");
+
+RGBDMeshOpt::RGBDMeshOpt() : color_cache_bytes_(0), pyramid_level_(0), robust_loss_(kSquaredLoss) {}
 
 RGBDMeshOpt::~RGBDMeshOpt() {}
 
@@ -511,6 +537,12 @@ bool RGBDMeshOpt::readRGBDFrames(
         color_image_format = ".png";
         depth_scale_factor_ = 5000;
     }
+    if (!FLAGS_frame_bundle.empty() && !frame_bundle_.isOpen() && !frame_bundle_.open(FLAGS_frame_bundle))
+        return false;
+    // Select keyframes and read their poses first
+    vector<int> keyframe_fidxs;
+    vector<string> keyframe_fnames;
+    vector<Matrix4d> keyframe_poses;
     int curr_fidx = start_fidx;
     while (curr_fidx <= end_fidx)
     {
@@ -537,37 +569,127 @@ bool RGBDMeshOpt::readRGBDFrames(
         // NOTE: default frame filename is like 'frame-000001.suffix'. Fix its format here.
         string frame_fname = "frame-" + string(6 - str_frame_idx.length(), '0') + str_frame_idx;
         Matrix4d T;
-        if (!readCameraPoseFile(rgbd_path + frame_fname + ".pose.txt", T))
+        if (frame_bundle_.isOpen())
+        {
+            double pose[16];
+            if (!frame_bundle_.readPose(keyframe_idx, pose))
+                return false;
+            T = Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor>>(pose);
+        }
+        else if (!readCameraPoseFile(rgbd_path + frame_fname + ".pose.txt", T))
             return false;
-        if (frames_.empty() || !isTwoPosesClose(frames_.back().T, T))
+        const Matrix4d* last_T = frames_.empty() ? nullptr : &frames_.back().T;
+        if (!keyframe_poses.empty())
+            last_T = &keyframe_poses.back();
+        if (last_T == nullptr || !isTwoPosesClose(*last_T, T))
         {  // Only add a new keyframe if it is NOT too close with previous keyframe
-
-            cv::Mat color_img, depth_img;
-            vector<int> visible_vertices;
-            if (!readColorImg(rgbd_path + frame_fname + ".color" + color_image_format, color_img) ||
-                !readDepthImg(rgbd_path + frame_fname + ".depth.png", depth_img) ||
-                !readVisibilityFile(visibility_path + frame_fname + ".visibility.txt", visible_vertices))
-            {  // NOTE: all depth images are in png in different data types, while color image is in jpg or png.
-                return false;
-            }
-            Frame frame;
-            frame.color_img = std::move(color_img);
-            frame.depth_img = std::move(depth_img);
-            frame.visible_vertices = std::move(visible_vertices);
-            frame.T = std::move(T);
-            frames_.push_back(frame);
-
-            // cout << "Adding keyframe " << keyframe_idx << endl;
-            // for (int vidx : frame.visible_vertices)
-            //     cout << vidx << " ";
-            // cout << endl;
+            keyframe_fidxs.push_back(keyframe_idx);
+            keyframe_fnames.push_back(frame_fname);
+            keyframe_poses.push_back(T);
         }
         curr_fidx += FLAGS_rgbd_frame_gap;
     }
+
+    // Read images and visibility of all keyframes in parallel, since decoding images is much slower than reading poses
+    const int kFirstFrame = int(frames_.size()), kKeyframeNum = int(keyframe_fnames.size());
+    frames_.resize(kFirstFrame + kKeyframeNum);
+    std::atomic<bool> flag_success(true);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < kKeyframeNum; ++i)
+    {
+        if (!flag_success)
+            continue;
+        const string& frame_fname = keyframe_fnames[i];
+        cv::Mat color_img, depth_img;
+        vector<int> visible_vertices;
+        string color_fname = rgbd_path + frame_fname + ".color" + color_image_format;
+        string visibility_fname = visibility_path + frame_fname + ".visibility.txt";
+        bool flag_read = false;
+        if (frame_bundle_.isOpen())
+        {  // Visibility may be computed after bundling frames, so read it from file if not bundled
+            int fidx = keyframe_fidxs[i];
+            flag_read = frame_bundle_.readColorImg(fidx, color_img) && frame_bundle_.readDepthImg(fidx, depth_img) &&
+                        (frame_bundle_.hasVisibility(fidx) ? frame_bundle_.readVisibility(fidx, visible_vertices)
+                                                           : readVisibilityFile(visibility_fname, visible_vertices));
+        }
+        else
+        {  // NOTE: all depth images are in png in different data types, while color image is in jpg or png.
+            flag_read = readColorImg(color_fname, color_img) &&
+                        readDepthImg(rgbd_path + frame_fname + ".depth.png", depth_img) &&
+                        readVisibilityFile(visibility_fname, visible_vertices);
+        }
+        if (!flag_read)
+        {
+            flag_success = false;
+            continue;
+        }
+        Frame& frame = frames_[kFirstFrame + i];
+        frame.source_idx = keyframe_fidxs[i];
+        frame.blurriness = image_blurriness_.at(keyframe_fidxs[i]);
+        // Gray image is always kept in memory, while color image may be evicted and read again when needed
+        cv::cvtColor(color_img, frame.gray_img, CV_RGB2GRAY);
+        frame.color_filename = color_fname;
+        frame.depth_img = std::move(depth_img);
+        frame.visible_vertices = std::move(visible_vertices);
+        frame.T = keyframe_poses[i];
+        if (FLAGS_frame_cache_mb > 0)
+            addFrameColorImageToCache(kFirstFrame + i, color_img);
+        else
+            frame.color_img = std::move(color_img);
+    }
+    if (!flag_success)
+        return false;
     cout << "#Keyframes: " << frames_.size() << endl;
     return true;
 }
 
+//! Get the color image of a frame. If frame cache is used, the image is read again if it has been evicted.
+//! Thread-safe. The returned image stays valid even if it's evicted from the cache later.
+cv::Mat RGBDMeshOpt::getFrameColorImage(int frame_idx)
+{
+    if (FLAGS_frame_cache_mb <= 0)
+        return frames_[frame_idx].color_img;
+    {
+        std::lock_guard<std::mutex> lock(color_cache_mutex_);
+        auto it = color_cache_pos_.find(frame_idx);
+        if (it != color_cache_pos_.end())
+        {
+            color_cache_lru_.splice(color_cache_lru_.begin(), color_cache_lru_, it->second);
+            return frames_[frame_idx].color_img;
+        }
+    }
+    cv::Mat img;
+    bool flag_read = frame_bundle_.isOpen() ? frame_bundle_.readColorImg(frames_[frame_idx].source_idx, img)
+                                            : readColorImg(frames_[frame_idx].color_filename, img);
+    if (!flag_read)
+        return img;
+    addFrameColorImageToCache(frame_idx, img);
+    return img;
+}
+
+//! Add a color image into the cache and evict least recently used images beyond the memory budget.
+void RGBDMeshOpt::addFrameColorImageToCache(int frame_idx, const cv::Mat& img)
+{
+    std::lock_guard<std::mutex> lock(color_cache_mutex_);
+    if (color_cache_pos_.find(frame_idx) != color_cache_pos_.end())
+        return;  // already read by another thread
+    const size_t kBudget = size_t(FLAGS_frame_cache_mb) << 20;
+    color_cache_lru_.push_front(frame_idx);
+    color_cache_pos_[frame_idx] = color_cache_lru_.begin();
+    frames_[frame_idx].color_img = img;
+    color_cache_bytes_ += img.total() * img.elemSize();
+    // Keep at least the newly added image
+    while (color_cache_bytes_ > kBudget && color_cache_lru_.size() > 1)
+    {
+        int evicted = color_cache_lru_.back();
+        color_cache_lru_.pop_back();
+        color_cache_pos_.erase(evicted);
+        cv::Mat& evicted_img = frames_[evicted].color_img;
+        color_cache_bytes_ -= evicted_img.total() * evicted_img.elemSize();
+        evicted_img.release();
+    }
+}
+
 bool RGBDMeshOpt::readColorImg(const string& filename, cv::Mat& img)
 {
     img = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
@@ -827,59 +949,167 @@ void RGBDMeshOpt::runOptimizationPipeline()
 void RGBDMeshOpt::runPlaneAndCameraPoseOpt()
 {
     cout << "Running plane and camera pose optimization ..." << endl;
+    if (FLAGS_robust_loss == "huber")
+        robust_loss_ = kHuberLoss;
+    else if (FLAGS_robust_loss == "cauchy")
+        robust_loss_ = kCauchyLoss;
+    else
+    {
+        if (FLAGS_robust_loss != "squared")
+        {
+            PRINT_YELLOW("WARNING: unknown robust loss %s, use squared loss.", FLAGS_robust_loss.c_str());
+        }
+        robust_loss_ = kSquaredLoss;
+    }
+    if (robust_loss_ != kSquaredLoss && !(FLAGS_robust_loss_scale > 0))
+    {
+        PRINT_YELLOW("WARNING: robust loss scale %f must be positive, use squared loss.", FLAGS_robust_loss_scale);
+        robust_loss_ = kSquaredLoss;
+    }
     last_global_energy_ = 1e10;  // some large number
     lambda1_ = 0;
     for (int loop = 0; loop < FLAGS_global_opt_loop_number; ++loop)
     {
         cout << "------------------------------------------" << endl;
-        cout << "Loop " << loop << ":" << endl;
-        cout << "Pose optimization: " << endl;
-        optimizePoses();
-        cout << "Plane optimization: " << endl;
-        optimizePlanes();
+        int level = getPyramidLevelOfLoop(loop);
+        if (level != pyramid_level_)
+        {
+            // Energies of different levels are computed on different texels, so they cannot be compared
+            setPyramidLevel(level);
+            computeAllTexelColors();
+            last_global_energy_ = last_color_energy_ = 1e10;
+        }
+        cout << "Loop " << loop << " (pyramid level " << level << "):" << endl;
+        if (FLAGS_joint_pose_plane_opt)
+        {
+            cout << "Joint pose and plane optimization: " << endl;
+            optimizePosesAndPlanes();
+        }
+        else
+        {
+            cout << "Pose optimization: " << endl;
+            optimizePoses();
+            cout << "Plane optimization: " << endl;
+            optimizePlanes();
+        }
         cout << "Color optimization ..." << endl;
         computeAllTexelColors();
     }
+    if (pyramid_level_ != 0)
+    {
+        setPyramidLevel(0);
+        computeAllTexelColors();
+    }
     cout << "DONE." << endl;
 }
 
+//! Pyramid level used in a global opt loop. Coarse levels are used in the first loops, each for
+//! 'pyramid_level_loop_number' loops, and at least the last loop is at full resolution.
+int RGBDMeshOpt::getPyramidLevelOfLoop(int loop)
+{
+    const int kLevelNum = std::max(1, FLAGS_pyramid_level_number);
+    const int kLoopsPerLevel = std::max(1, FLAGS_pyramid_level_loop_number);
+    int coarse_loop_num = std::min((kLevelNum - 1) * kLoopsPerLevel, std::max(0, FLAGS_global_opt_loop_number - 1));
+    if (loop >= coarse_loop_num)
+        return 0;
+    return kLevelNum - 1 - loop / kLoopsPerLevel;
+}
+
+//! Set the pyramid level of images used in plane and pose opt. At level l, only texels on a grid with
+//! step 2^l are used, and gray colors and gradients are sampled from images downsampled by 2^l.
+void RGBDMeshOpt::setPyramidLevel(int level)
+{
+    pyramid_level_ = std::max(0, std::min(level, FLAGS_pyramid_level_number - 1));
+}
+
+bool RGBDMeshOpt::isTexelInPyramidLevel(int texel_idx)
+{
+    const int kMask = (1 << pyramid_level_) - 1;
+    return (texels_.position[texel_idx][0] & kMask) == 0 && (texels_.position[texel_idx][1] & kMask) == 0;
+}
+
 //! Optimize camera poses in all frames
+/*!
+    Jacobians are accumulated in parallel over patches. Each thread has its own JTJ and JTr of all frames, and
+    patches are statically assigned to threads, then per-thread results are merged in thread order, so the
+    summation order (and the result) is deterministic for a given thread number.
+*/
 void RGBDMeshOpt::optimizePoses()
 {
-    VectorXd jrow(6);
+    int thread_num = 1;
+#ifdef _OPENMP
+    thread_num = omp_get_max_threads();
+#endif
+    const int kPatchNum = int(patches_.size());
+    vector<vector<Matrix6d>> thread_JTJ(thread_num, vector<Matrix6d>(frame_num_, Matrix6d::Zero()));
+    vector<vector<Vector6d>> thread_JTr(thread_num, vector<Vector6d>(frame_num_, Vector6d::Zero()));
+    vector<double> thread_energy1(thread_num), thread_energy2(thread_num);
     for (int iter = 0; iter < FLAGS_pose_opt_loop_number; ++iter)
     {
         double energy1 = 0, energy2 = 0;  // energy 1 is for color difference, energy2 is for point-plane distance
-        for (int fidx = 0; fidx < frame_num_; ++fidx)
+        updateTexelVisibilityCache();
+        // All buffers are cleared here, since the runtime may give a smaller team than 'thread_num'
+        for (int t = 0; t < thread_num; ++t)
         {
-            frames_[fidx].JTJ.setZero();
-            frames_[fidx].JTr.setZero();
+            for (int fidx = 0; fidx < frame_num_; ++fidx)
+            {
+                thread_JTJ[t][fidx].setZero();
+                thread_JTr[t][fidx].setZero();
+            }
+            thread_energy1[t] = thread_energy2[t] = 0;
         }
-        for (TexturePatch& patch : patches_)
+#pragma omp parallel num_threads(thread_num)
         {
-            int cidx = patch.cluster_id;
-            int tidx = patch.texture_img_idx;
-            const Vector3d& kNormal = clusters_[cidx].opt_normal;
-            const double& kW = clusters_[cidx].opt_w;
-            for (auto it : patch.texel_positions)
+            int tid = 0;
+#ifdef _OPENMP
+            tid = omp_get_thread_num();
+#endif
+            vector<Matrix6d>& JTJ = thread_JTJ[tid];
+            vector<Vector6d>& JTr = thread_JTr[tid];
+            double local_energy1 = 0, local_energy2 = 0;
+            Vector6d jrow;
+            vector<TexelProjection> projections;
+            vector<Vector2d> pts, grads;
+            vector<double> grays;
+#pragma omp for schedule(static, 1)
+            for (int pidx = 0; pidx < kPatchNum; ++pidx)
             {
-                int x = it.first, y = it.second;
-                Texel& texel = texels_[tidx][y][x];
-                int fa = texel.face_id;
-                double opt_graycolor = texel.opt_graycolor;
-                bool flag_run_color_opt = false;
-                for (int fidx : faces_[fa].visible_frames)
+                const TexturePatch& patch = patches_[pidx];
+                int cidx = patch.cluster_id;
+                const Vector3d& kNormal = clusters_[cidx].opt_normal;
+                const double& kW = clusters_[cidx].opt_w;
+                projections.clear();
+                for (int t = patch.texel_begin; t < patch.texel_end; ++t)
                 {
-                    Vector3d pt3_local = globalToCameraSpace(texel.pt3_proj, frames_[fidx].opt_inv_T);
-                    Vector2d pt2_color;
-                    if (!isCameraPointVisibleInFrame(pt3_local, fidx, pt2_color))
+                    if (!isTexelInPyramidLevel(t))
                         continue;
-                    Vector2d grad = compute2DPointGraycolorGradientBilinear(pt2_color, fidx);
+                    bool flag_run_color_opt = false;
+                    for (int k = texel_frame_offsets_[t]; k < texel_frame_offsets_[t + 1]; ++k)
+                    {
+                        TexelProjection proj;
+                        if (!projectTexelToCachedFrame(texels_.pt3_proj[t], k, proj.pt3_local, proj.pt2_color))
+                            continue;
+                        proj.texel_idx = t;
+                        proj.frame_idx = texel_frames_[k];
+                        projections.push_back(proj);
+                        flag_run_color_opt = true;
+                    }
+                    if (flag_run_color_opt)
+                    {
+                        double dis_pt2plane = texels_.pt3_global[t].dot(kNormal) + kW;
+                        local_energy2 += dis_pt2plane * dis_pt2plane;
+                    }
+                }
+                sampleTexelProjections(projections, pts, grays, grads);
+                for (size_t i = 0; i < projections.size(); ++i)
+                {
+                    const TexelProjection& proj = projections[i];
+                    int fidx = proj.frame_idx;
                     // Compute Jacobian of energy1 (color difference term) w.r.t. delta pose
                     // Refer to math derivation for more details.
-                    double x = pt3_local[0], y = pt3_local[1], z = pt3_local[2];
-                    double a = grad[0] * color_calib_.fx / z;
-                    double b = grad[1] * color_calib_.fy / z;
+                    double x = proj.pt3_local[0], y = proj.pt3_local[1], z = proj.pt3_local[2];
+                    double a = grads[i][0] * color_calib_.fx / z;
+                    double b = grads[i][1] * color_calib_.fy / z;
                     double c = -(a * x + b * y) / z;
                     jrow[0] = -b * z + c * y;
                     jrow[1] = a * z - c * x;
@@ -887,27 +1117,31 @@ void RGBDMeshOpt::optimizePoses()
                     jrow[3] = a;
                     jrow[4] = b;
                     jrow[5] = c;
-                    double r = compute2DPointGraycolorBilinear(pt2_color, fidx) - opt_graycolor;
-                    for (int i = 0; i < 6; ++i)
-                    {
-                        frames_[fidx].JTr(i, 0) += jrow[i] * r;
-                        frames_[fidx].JTJ(i, i) += jrow[i] * jrow[i];
-                        for (int j = i + 1; j < 6; ++j)
-                        {
-                            double val = jrow[i] * jrow[j];
-                            frames_[fidx].JTJ(i, j) += val;
-                            frames_[fidx].JTJ(j, i) += val;
-                        }
-                    }
-                    energy1 += r * r;
-                    flag_run_color_opt = true;
-                }
-                if (flag_run_color_opt)
-                {
-                    double dis_pt2plane = texel.pt3_global.dot(kNormal) + kW;
-                    energy2 += dis_pt2plane * dis_pt2plane;
+                    double r = grays[i] - texels_.opt_graycolor[proj.texel_idx];
+                    double weight = computeRobustWeight(r);
+                    JTr[fidx] += jrow * (weight * r);
+                    JTJ[fidx].triangularView<Upper>() += weight * jrow * jrow.transpose();
+                    local_energy1 += computeRobustLoss(r);
                 }
             }
+            thread_energy1[tid] = local_energy1;
+            thread_energy2[tid] = local_energy2;
+        }
+        // Merge results of all threads in a fixed order
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
+        {
+            frames_[fidx].JTJ = thread_JTJ[0][fidx];
+            frames_[fidx].JTr = thread_JTr[0][fidx];
+            for (int t = 1; t < thread_num; ++t)
+            {
+                frames_[fidx].JTJ += thread_JTJ[t][fidx];
+                frames_[fidx].JTr += thread_JTr[t][fidx];
+            }
+        }
+        for (int t = 0; t < thread_num; ++t)
+        {
+            energy1 += thread_energy1[t];
+            energy2 += thread_energy2[t];
         }
         if (lambda1_ == 0 && energy2 != 0)
             lambda1_ = energy1 / energy2;
@@ -917,54 +1151,110 @@ void RGBDMeshOpt::optimizePoses()
         if (last_global_energy_ < curr_global_energy_)
         {
             // Recover result in last iteration which is better.
+#pragma omp parallel for schedule(static)
             for (int fidx = 0; fidx < frame_num_; ++fidx)
-                frames_[fidx].opt_inv_T = frames_[fidx].lastT;
+                setFrameOptPose(fidx, frames_[fidx].lastT);
             curr_global_energy_ = last_global_energy_;
             break;
         }
         last_color_energy_ = energy1;
         last_global_energy_ = curr_global_energy_;
+        // Frames are independent, so each one solves and applies its update in parallel
+#pragma omp parallel for schedule(static)
         for (int fidx = 0; fidx < frame_num_; ++fidx)
         {
-            MatrixXd Xi = -frames_[fidx].JTJ.llt().solve(frames_[fidx].JTr);
-            bool flag_is_Xi_finite = true;
-            for (int i = 0; i < 6; ++i)
+            Frame& frame = frames_[fidx];
+            frame.lastT = frame.opt_inv_T;
+            Vector6d Xi = -frame.JTJ.selfadjointView<Upper>().llt().solve(frame.JTr);
+            if (!Xi.allFinite())
             {
-                if (!isfinite(Xi(i, 0)))
-                {
-                    PRINT_YELLOW("WARNING: camera pose in frame %d cannot be optimized more.", fidx);
-                    flag_is_Xi_finite = false;
-                    break;
-                }
-            }
-            if (!flag_is_Xi_finite)
+#pragma omp critical(print)
+                PRINT_YELLOW("WARNING: camera pose in frame %d cannot be optimized more.", fidx);
                 continue;
-            // Recover rotation matrix via. Rodrigues' formula
-            Eigen::Affine3d aff_mat;
-            aff_mat.linear() = (Eigen::Matrix3d)Eigen::AngleAxisd(Xi(2), Eigen::Vector3d::UnitZ()) *
-                               Eigen::AngleAxisd(Xi(1), Eigen::Vector3d::UnitY()) *
-                               Eigen::AngleAxisd(Xi(0), Eigen::Vector3d::UnitX());
-            aff_mat.translation() = Eigen::Vector3d(Xi(3), Xi(4), Xi(5));
-            Matrix4d delta = aff_mat.matrix();
-            frames_[fidx].lastT = frames_[fidx].opt_inv_T;
-            frames_[fidx].opt_inv_T = delta * frames_[fidx].opt_inv_T;
+            }
+            setFrameOptPose(fidx, expSE3(Xi) * frame.opt_inv_T);
         }
     }
-    // Set all relevant variables w.r.t. optimized poses
-    for (int fidx = 0; fidx < frame_num_; ++fidx)
+}
+
+//! Exponential map from a twist (rotation vector, translation) to a rigid transformation in SE(3).
+/*!
+    Xi = (w, v), and exp(Xi) = [R, V * v; 0, 1], where R = I + A * W + B * W^2 and V = I + B * W + C * W^2,
+    W = [w]x, theta = |w|, A = sin(theta) / theta, B = (1 - cos(theta)) / theta^2, C = (theta - sin(theta)) / theta^3.
+    Taylor expansions are used for very small rotations.
+*/
+Matrix4d RGBDMeshOpt::expSE3(const Vector6d& Xi)
+{
+    Vector3d w = Xi.head<3>(), v = Xi.tail<3>();
+    double theta_sq = w.squaredNorm(), theta = sqrt(theta_sq);
+    double A, B, C;
+    if (theta < 1e-4)
+    {
+        A = 1 - theta_sq / 6;
+        B = 0.5 - theta_sq / 24;
+        C = 1.0 / 6 - theta_sq / 120;
+    }
+    else
     {
-        frames_[fidx].opt_inv_R = frames_[fidx].opt_inv_T.block(0, 0, 3, 3);
-        frames_[fidx].opt_inv_t = frames_[fidx].opt_inv_T.block(0, 3, 3, 1);
-        frames_[fidx].opt_T = frames_[fidx].opt_inv_T.inverse();
-        frames_[fidx].opt_R = frames_[fidx].opt_T.block(0, 0, 3, 3);
-        frames_[fidx].opt_t = frames_[fidx].opt_T.block(0, 3, 3, 1);
+        A = sin(theta) / theta;
+        B = (1 - cos(theta)) / theta_sq;
+        C = (theta - sin(theta)) / (theta_sq * theta);
     }
+    Matrix3d W;
+    W << 0, -w[2], w[1], w[2], 0, -w[0], -w[1], w[0], 0;
+    Matrix3d W_sq = W * W;
+    Matrix4d T = Matrix4d::Identity();
+    T.topLeftCorner<3, 3>() = Matrix3d::Identity() + A * W + B * W_sq;
+    T.topRightCorner<3, 1>() = (Matrix3d::Identity() + B * W + C * W_sq) * v;
+    return T;
 }
 
+//! Set the optimized pose of a frame by its inverse 'inv_T' (global to camera), and update all relevant variables.
+void RGBDMeshOpt::setFrameOptPose(int frame_idx, const Matrix4d& inv_T)
+{
+    Frame& frame = frames_[frame_idx];
+    frame.opt_inv_T = inv_T;
+    frame.opt_inv_R = inv_T.topLeftCorner<3, 3>();
+    frame.opt_inv_t = inv_T.topRightCorner<3, 1>();
+    // Inverse of a rigid transformation
+    frame.opt_R = frame.opt_inv_R.transpose();
+    frame.opt_t = -frame.opt_R * frame.opt_inv_t;
+    frame.opt_T.setIdentity();
+    frame.opt_T.topLeftCorner<3, 3>() = frame.opt_R;
+    frame.opt_T.topRightCorner<3, 1>() = frame.opt_t;
+}
+
+//! Optimize plane parameters of all clusters
+/*!
+    Each patch belongs to exactly one cluster, so the accumulation is split into tasks of contiguous texel ranges
+    of a patch (large patches have several tasks). Tasks are dynamically scheduled over threads, and each task has
+    its own JTJ, JTr and energies, which are merged in task order, so the result does not depend on the scheduling.
+*/
 void RGBDMeshOpt::optimizePlanes()
 {
-    Vector3d res_p2pixel;
-    MatrixXd m13(1, 3), m34(3, 4), m14(1, 4), Xi(4, 1);
+    struct PlaneOptTask
+    {
+        int patch_idx, begin, end;  // texel range [begin, end) in 'texels_', inside range of the patch
+        Matrix4d JTJ;  // only the upper triangular part is accumulated
+        Vector4d JTr;
+        double energy1, energy2;
+        bool is_optimized;
+    };
+    const int kTaskTexelNum = 4096;  // max number of texels in one task
+    vector<PlaneOptTask> tasks;
+    for (int pidx = 0; pidx < int(patches_.size()); ++pidx)
+    {
+        const TexturePatch& patch = patches_[pidx];
+        for (int begin = patch.texel_begin; begin < patch.texel_end; begin += kTaskTexelNum)
+        {
+            PlaneOptTask task;
+            task.patch_idx = pidx;
+            task.begin = begin;
+            task.end = std::min(begin + kTaskTexelNum, patch.texel_end);
+            tasks.push_back(std::move(task));
+        }
+    }
+    const int kTaskNum = int(tasks.size());
     const double kSqrtLambda1 = sqrt(lambda1_);
     for (int iter = 0; iter < FLAGS_plane_opt_loop_number; ++iter)
     {
@@ -975,81 +1265,95 @@ void RGBDMeshOpt::optimizePlanes()
             clusters_[cidx].is_optimized = false;
         }
         double energy1 = 0, energy2 = 0;
-        for (TexturePatch& patch : patches_)
+        updateTexelVisibilityCache();
+#pragma omp parallel
         {
-            int cidx = patch.cluster_id;
-            int tidx = patch.texture_img_idx;
-            const Vector3d& kNormal = clusters_[cidx].opt_normal;
-            const double& kW = clusters_[cidx].opt_w;
-            for (auto it : patch.texel_positions)
+            RowVector3d m13;
+            Matrix<double, 3, 4> m34;
+            RowVector4d m14;
+            vector<TexelProjection> projections;
+            vector<Vector2d> pts, grads;
+            vector<double> grays;
+#pragma omp for schedule(dynamic, 1)
+            for (int task_idx = 0; task_idx < kTaskNum; ++task_idx)
             {
-                int x = it.first, y = it.second;
-                Texel& texel = texels_[tidx][y][x];
-                int fa = texel.face_id;
-                double opt_graycolor = texel.opt_graycolor;
-                double dis_pt2plane = texel.pt3_global.dot(kNormal) + kW;
-                texel.pt3_proj = texel.pt3_global - dis_pt2plane * kNormal;
-                bool flag_run_color_opt = false;
-                for (int fidx : faces_[fa].visible_frames)
+                PlaneOptTask& task = tasks[task_idx];
+                task.JTJ.setZero();
+                task.JTr.setZero();
+                task.energy1 = task.energy2 = 0;
+                task.is_optimized = false;
+                const TexturePatch& patch = patches_[task.patch_idx];
+                int cidx = patch.cluster_id;
+                const Vector3d& kNormal = clusters_[cidx].opt_normal;
+                const double& kW = clusters_[cidx].opt_w;
+                projections.clear();
+                for (int t = task.begin; t < task.end; ++t)
                 {
-                    Vector3d pt3_local = globalToCameraSpace(texel.pt3_proj, frames_[fidx].opt_inv_T);
-                    Vector2d pt2_color;
-                    if (!isCameraPointVisibleInFrame(pt3_local, fidx, pt2_color))
+                    if (!isTexelInPyramidLevel(t))
                         continue;
-                    Vector2d grad = compute2DPointGraycolorGradientBilinear(pt2_color, fidx);
-                    // Compute Jacobian of energy1 (color difference term) w.r.t. plane normal and w
-                    // Refer to math derivation for more details.
-                    double x = pt3_local[0], y = pt3_local[1], z = pt3_local[2];
-                    m13(0, 0) = grad[0] * color_calib_.fx / z;
-                    m13(0, 1) = grad[1] * color_calib_.fy / z;
-                    m13(0, 2) = -(m13(0, 0) * x + m13(0, 1) * y) / z;
-                    Vector3d Rjni = frames_[fidx].opt_inv_R * kNormal;
-                    for (int i = 0; i < 3; ++i)
+                    const Vector3d& pt3_global = texels_.pt3_global[t];
+                    double dis_pt2plane = pt3_global.dot(kNormal) + kW;
+                    texels_.pt3_proj[t] = pt3_global - dis_pt2plane * kNormal;
+                    bool flag_run_color_opt = false;
+                    for (int k = texel_frame_offsets_[t]; k < texel_frame_offsets_[t + 1]; ++k)
                     {
-                        m34(0, i) = -Rjni[i];
-                        for (int j = 0; j < 3; ++j)
-                            m34(i, j) = -Rjni(i) * texel.pt3_global[j] - dis_pt2plane * frames_[fidx].opt_inv_R(i, j);
+                        TexelProjection proj;
+                        if (!projectTexelToCachedFrame(texels_.pt3_proj[t], k, proj.pt3_local, proj.pt2_color))
+                            continue;
+                        proj.texel_idx = t;
+                        proj.frame_idx = texel_frames_[k];
+                        projections.push_back(proj);
+                        flag_run_color_opt = true;
                     }
-                    m14 = m13 * m34;
-                    double r = compute2DPointGraycolorBilinear(pt2_color, fidx) - opt_graycolor;
-                    for (int i = 0; i < 4; ++i)
+                    if (flag_run_color_opt)
                     {
-                        clusters_[cidx].JTr(i, 0) += m14(0, i) * r;  // Note that JTr is 4x1 but m14 matrix is 1x4
-                        clusters_[cidx].JTJ(i, i) += m14(0, i) * m14(0, i);
-                        for (int j = i + 1; j < 4; ++j)
-                        {
-                            double val = m14(0, i) * m14(0, j);
-                            clusters_[cidx].JTJ(i, j) += val;
-                            clusters_[cidx].JTJ(j, i) += val;
-                        }
+                        // Compute Jacobian of regularization term
+                        double r = kSqrtLambda1 * dis_pt2plane;
+                        task.energy2 += dis_pt2plane * dis_pt2plane;
+                        Vector4d jrow(pt3_global[0], pt3_global[1], pt3_global[2], 1);
+                        jrow *= kSqrtLambda1;
+                        task.JTr += jrow * r;
+                        task.JTJ.triangularView<Upper>() += jrow * jrow.transpose();
+                        // Remember to update flag for the plane
+                        task.is_optimized = true;
                     }
-                    energy1 += r * r;
-                    flag_run_color_opt = true;
                 }
-                if (flag_run_color_opt)
+                sampleTexelProjections(projections, pts, grays, grads);
+                for (size_t i = 0; i < projections.size(); ++i)
                 {
-                    // Compute Jacobian of regularization term
-                    double r = kSqrtLambda1 * dis_pt2plane;
-                    energy2 += dis_pt2plane * dis_pt2plane;
-                    Vector4d jrow(texel.pt3_global[0], texel.pt3_global[1], texel.pt3_global[2], 1);
-                    jrow *= kSqrtLambda1;
-                    for (int i = 0; i < 4; ++i)
-                    {
-                        clusters_[cidx].JTr(i, 0) += jrow[i] * r;
-                        clusters_[cidx].JTJ(i, i) += jrow[i] * jrow[i];
-                        for (int j = i + 1; j < 4; ++j)
-                        {
-                            double val = jrow[i] * jrow[j];
-                            clusters_[cidx].JTJ(i, j) += val;
-                            clusters_[cidx].JTJ(j, i) += val;
-                        }
-                    }
-                    // Remember to update flag for the plane
-                    if (!clusters_[cidx].is_optimized)
-                        clusters_[cidx].is_optimized = true;
+                    const TexelProjection& proj = projections[i];
+                    int fidx = proj.frame_idx;
+                    const Vector3d& pt3_global = texels_.pt3_global[proj.texel_idx];
+                    double dis_pt2plane = pt3_global.dot(kNormal) + kW;
+                    // Compute Jacobian of energy1 (color difference term) w.r.t. plane normal and w
+                    // Refer to math derivation for more details.
+                    double x = proj.pt3_local[0], y = proj.pt3_local[1], z = proj.pt3_local[2];
+                    m13[0] = grads[i][0] * color_calib_.fx / z;
+                    m13[1] = grads[i][1] * color_calib_.fy / z;
+                    m13[2] = -(m13[0] * x + m13[1] * y) / z;
+                    Vector3d Rjni = frames_[fidx].opt_inv_R * kNormal;
+                    m34.leftCols<3>() = -Rjni * pt3_global.transpose() - dis_pt2plane * frames_[fidx].opt_inv_R;
+                    m34.col(3) = -Rjni;
+                    m14.noalias() = m13 * m34;
+                    double r = grays[i] - texels_.opt_graycolor[proj.texel_idx];
+                    double weight = computeRobustWeight(r);
+                    task.JTr += m14.transpose() * (weight * r);  // Note that JTr is 4x1 but m14 matrix is 1x4
+                    task.JTJ.triangularView<Upper>() += weight * m14.transpose() * m14;
+                    task.energy1 += computeRobustLoss(r);
                 }
             }
         }
+        // Merge results of all tasks in a fixed order
+        for (const PlaneOptTask& task : tasks)
+        {
+            int cidx = patches_[task.patch_idx].cluster_id;
+            clusters_[cidx].JTJ += task.JTJ;
+            clusters_[cidx].JTr += task.JTr;
+            if (task.is_optimized)
+                clusters_[cidx].is_optimized = true;
+            energy1 += task.energy1;
+            energy2 += task.energy2;
+        }
         energy2 *= lambda1_;
         curr_global_energy_ = energy1 + energy2;  // the energy2 already considers lambda1
         cout << "   Energy (iter " << iter << "): " << curr_global_energy_ << " (" << energy1 << " + " << energy2 << ")"
@@ -1069,20 +1373,22 @@ void RGBDMeshOpt::optimizePlanes()
         }
         last_color_energy_ = energy1;
         last_global_energy_ = curr_global_energy_;
+#pragma omp parallel for schedule(dynamic, 16)
         for (int cidx = 0; cidx < cluster_num_; ++cidx)
         {
             if (!clusters_[cidx].is_optimized)
                 continue;
-            Xi = -clusters_[cidx].JTJ.llt().solve(clusters_[cidx].JTr);
-            if (!isfinite(Xi(0, 0)) || !isfinite(Xi(1, 0)) || !isfinite(Xi(2, 0)) || !isfinite(Xi(3, 0)))
+            Vector4d Xi = -clusters_[cidx].JTJ.selfadjointView<Upper>().llt().solve(clusters_[cidx].JTr);
+            if (!isfinite(Xi[0]) || !isfinite(Xi[1]) || !isfinite(Xi[2]) || !isfinite(Xi[3]))
             {
+#pragma omp critical(print)
                 PRINT_YELLOW("WARNING: cluster %d cannot be optimized more.", cidx);
                 continue;
             }
             clusters_[cidx].last_normal = clusters_[cidx].opt_normal;
             clusters_[cidx].last_w = clusters_[cidx].opt_w;
-            clusters_[cidx].opt_normal += Xi.block(0, 0, 3, 1);
-            clusters_[cidx].opt_w += Xi(3, 0);
+            clusters_[cidx].opt_normal += Xi.head<3>();
+            clusters_[cidx].opt_w += Xi[3];
             double len = clusters_[cidx].opt_normal.norm();
             clusters_[cidx].opt_normal.normalize();
             clusters_[cidx].opt_w /= len;
@@ -1090,227 +1396,924 @@ void RGBDMeshOpt::optimizePlanes()
     }
 }
 
-//! Get all connected components of the mesh by BFS. Result is in 'connected_components_'.
-void RGBDMeshOpt::getConnectedComponents()
+//! Optimize camera poses and plane parameters jointly by Levenberg-Marquardt
+/*!
+    Unlike alternating 'optimizePoses()' and 'optimizePlanes()', the normal equations of all poses and planes are
+    solved together, so the coupling between a frame and the planes it observes is not lost. Each iteration costs one
+    pass over texels: the linearization at a trial step gives both its energy and, if accepted, the next system.
+    The damping is updated by the gain ratio (Nielsen's rule), and rejected steps are reverted.
+*/
+void RGBDMeshOpt::optimizePosesAndPlanes()
 {
-    for (int i = 0; i < vertex_num_; ++i)
-        vertices_[i].is_visited = false;
-    queue<int> qu;
-    for (int i = 0; i < vertex_num_; ++i)
+    JointSystem system, trial;
+    updateTexelVisibilityCache();
+    buildJointSystem(system);
+    double energy = system.energy1 + lambda1_ * system.energy2;
+    cout << "Energy (iter 0): " << energy << " (" << system.energy1 << " + " << lambda1_ * system.energy2 << ")" << endl;
+    double damping = 1e-4, nu = 2;
+    vector<Vector6d> pose_deltas;
+    vector<Vector4d> plane_deltas;
+    for (int iter = 1; iter <= FLAGS_joint_opt_loop_number; ++iter)
     {
-        if (vertices_[i].is_visited)
+        double predicted_decrease = 0;
+        if (!solveJointSystem(system, damping, pose_deltas, plane_deltas, predicted_decrease) || predicted_decrease <= 0)
+        {
+            damping *= nu;
+            nu *= 2;
             continue;
-        qu.push(i);
-        vertices_[i].is_visited = true;
-        vector<int> vset;
-        while (!qu.empty())
+        }
+#pragma omp parallel for schedule(static)
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
         {
-            int v = qu.front();
-            qu.pop();
-            vset.push_back(v);
-            for (int nv : vertices_[v].nbr_vertices)
+            frames_[fidx].lastT = frames_[fidx].opt_inv_T;
+            setFrameOptPose(fidx, expSE3(pose_deltas[fidx]) * frames_[fidx].opt_inv_T);
+        }
+#pragma omp parallel for schedule(static)
+        for (int cidx = 0; cidx < cluster_num_; ++cidx)
+        {
+            if (!system.is_cluster_optimized[cidx])
+                continue;
+            Cluster& cluster = clusters_[cidx];
+            cluster.last_normal = cluster.opt_normal;
+            cluster.last_w = cluster.opt_w;
+            cluster.opt_normal += plane_deltas[cidx].head<3>();
+            cluster.opt_w += plane_deltas[cidx][3];
+            double len = cluster.opt_normal.norm();
+            cluster.opt_normal.normalize();
+            cluster.opt_w /= len;
+        }
+        updateTexelVisibilityCache();
+        buildJointSystem(trial);
+        double trial_energy = trial.energy1 + lambda1_ * trial.energy2;
+        // Energies are sums of squared residuals, i.e. twice the quadratic model of the normal equations
+        double rho = (energy - trial_energy) / (2 * predicted_decrease);
+        cout << "Energy (iter " << iter << "): " << trial_energy << " (" << trial.energy1 << " + "
+             << lambda1_ * trial.energy2 << "), damping " << damping << (rho > 0 ? "" : ", rejected") << endl;
+        if (rho > 0)
+        {
+            std::swap(system, trial);
+            energy = trial_energy;
+            damping *= std::max(1.0 / 3, 1 - pow(2 * rho - 1, 3));
+            nu = 2;
+        }
+        else
+        {
+            // Recover poses and planes before the step
+#pragma omp parallel for schedule(static)
+            for (int fidx = 0; fidx < frame_num_; ++fidx)
+                setFrameOptPose(fidx, frames_[fidx].lastT);
+            for (int cidx = 0; cidx < cluster_num_; ++cidx)
             {
-                if (!vertices_[nv].is_visited)
+                if (!system.is_cluster_optimized[cidx])
+                    continue;
+                clusters_[cidx].opt_normal = clusters_[cidx].last_normal;
+                clusters_[cidx].opt_w = clusters_[cidx].last_w;
+            }
+            // The trial pass projected texels onto the rejected planes, so project them onto the recovered planes
+            // again (later color and geometry opt read them), and rebuild the visibility cache for recovered poses.
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int pidx = 0; pidx < int(patches_.size()); ++pidx)
+            {
+                const TexturePatch& patch = patches_[pidx];
+                const Vector3d& kNormal = clusters_[patch.cluster_id].opt_normal;
+                const double& kW = clusters_[patch.cluster_id].opt_w;
+                for (int t = patch.texel_begin; t < patch.texel_end; ++t)
                 {
-                    vertices_[nv].is_visited = true;
-                    qu.push(nv);
+                    const Vector3d& pt3_global = texels_.pt3_global[t];
+                    texels_.pt3_proj[t] = pt3_global - (pt3_global.dot(kNormal) + kW) * kNormal;
                 }
             }
+            updateTexelVisibilityCache();
+            damping *= nu;
+            nu *= 2;
         }
-        connected_components_.push_back(std::move(vset));
     }
+    last_color_energy_ = system.energy1;
+    last_global_energy_ = curr_global_energy_ = energy;
 }
 
-void RGBDMeshOpt::runMeshGeometryOpt()
+//! Linearize the joint pose and plane problem at the current poses and planes by one pass over texels.
+/*!
+    Texels are split into tasks of contiguous ranges of a patch as in 'optimizePlanes()'. Each task accumulates the
+    blocks of its cluster and of the frames it is observed in, and tasks are merged in task order, so the result
+    does not depend on the scheduling. The point-plane term is accumulated without weight and added with 'lambda1_',
+    which is set from the energies of the first pass.
+*/
+void RGBDMeshOpt::buildJointSystem(JointSystem& system)
 {
-    // Get connected components and run optimization per component, since we need to
-    // ensure all vertices to be optimized are connected.
-    getConnectedComponents();
-
-    // In order to ensure that Laplacian matrix is full-rank (non-sigular),
-    // we fix the position of one single vertex for each connected component.
-    // Here we use the first vertex in each connected component.
-    const int kComponentNum = int(connected_components_.size());
-    vector<int> component_vertices;
-    for (int i = 0; i < kComponentNum; ++i)
+    struct TaskFrameBlock
     {
-        int vidx = connected_components_[i][0];
-        component_vertices.push_back(vidx);
-        vertices_[vidx].component_id_x = i;
-        connected_components_[i].erase(connected_components_[i].begin());
-    }
-    // Save each vertex's position in connected components
-    for (int i = 0; i < kComponentNum; ++i)
+        int frame_idx;
+        Matrix6d U;
+        Vector6d bu;
+        Matrix64d W;
+    };
+    struct JointOptTask
     {
-        for (int j = 0; j < int(connected_components_[i].size()); ++j)
+        int patch_idx, begin, end;  // texel range [begin, end) in 'texels_', inside range of the patch
+        Matrix4d V, V_plane;        // color term and (unweighted) point-plane term of the cluster
+        Vector4d bv, bv_plane;
+        vector<TaskFrameBlock> frame_blocks;
+        double energy1, energy2;
+        bool is_optimized;
+    };
+    const int kTaskTexelNum = 4096;  // max number of texels in one task
+    vector<JointOptTask> tasks;
+    for (int pidx = 0; pidx < int(patches_.size()); ++pidx)
+    {
+        const TexturePatch& patch = patches_[pidx];
+        for (int begin = patch.texel_begin; begin < patch.texel_end; begin += kTaskTexelNum)
         {
-            int vidx = connected_components_[i][j];
-            vertices_[vidx].component_id_x = i;
-            vertices_[vidx].component_id_y = j;
+            JointOptTask task;
+            task.patch_idx = pidx;
+            task.begin = begin;
+            task.end = std::min(begin + kTaskTexelNum, patch.texel_end);
+            tasks.push_back(std::move(task));
         }
     }
-    vector<MatrixXd> JTRs;  // for all components
-    for (int i = 0; i < kComponentNum; ++i)
-    {
-        int n = int(connected_components_[i].size());
-        MatrixXd JTR(n, 3);
-        JTR.setZero();
-        JTRs.push_back(JTR);
-    }
-    cout << "Computing Jacobian for all components ..." << endl;
-
-    /// Create geometry term of Jacobian matrix for all components
-    // Long long int is the 2D position in the large Jacobian matrix. We use sparse matrix here so
-    // have to store for each 2D position its Jacobian value. So it's a 2D pair -> double mapping.
-    vector<unordered_map<long long, double>> spmat_values(kComponentNum);
-    int oldv[3], newv[3];  // original vertex index and new index in Jacobian matrix
-    for (TexturePatch& patch : patches_)
+    const int kTaskNum = int(tasks.size());
+#pragma omp parallel
     {
-        for (auto it : patch.texel_positions)
+        vector<int> frame_slots(frame_num_, -1);  // position of each frame in 'frame_blocks' of the current task
+        Vector6d jrow;
+        RowVector3d m13;
+        Matrix<double, 3, 4> m34;
+        RowVector4d m14;
+        vector<TexelProjection> projections;
+        vector<Vector2d> pts, grads;
+        vector<double> grays;
+#pragma omp for schedule(dynamic, 1)
+        for (int task_idx = 0; task_idx < kTaskNum; ++task_idx)
         {
-            int x = it.first, y = it.second;
-            Texel& texel = texels_[patch.texture_img_idx][y][x];
-            int fa = texel.face_id;
-            if (fa == -1)
-                continue;
-            int cidx = vertices_[faces_[fa].indices[0]].component_id_x;  // component index
-            int fixed_vidx = component_vertices[cidx];
-            const Vector3d& q = texel.pt3_proj;
-
-            // Check if the face contains the fixed vertex in the component
-            int idx_in_face = -1;
-            for (int i = 0; i < 3; ++i)
-            {
-                oldv[i] = faces_[fa].indices[i];
-                newv[i] = vertices_[oldv[i]].component_id_y;
-                if (oldv[i] == fixed_vidx)
-                    idx_in_face = i;
-            }
-            if (idx_in_face != -1)
+            JointOptTask& task = tasks[task_idx];
+            task.V.setZero();
+            task.V_plane.setZero();
+            task.bv.setZero();
+            task.bv_plane.setZero();
+            task.energy1 = task.energy2 = 0;
+            task.is_optimized = false;
+            const TexturePatch& patch = patches_[task.patch_idx];
+            int cidx = patch.cluster_id;
+            const Vector3d& kNormal = clusters_[cidx].opt_normal;
+            const double& kW = clusters_[cidx].opt_w;
+            projections.clear();
+            for (int t = task.begin; t < task.end; ++t)
             {
-                // This is the special case that one vertex of the face is the fixed vertex in
-                // the connected component. We need to deal with this specifically.
-                int idx1 = (idx_in_face + 1) % 3, idx2 = (idx_in_face + 2) % 3;
-                int v1 = newv[idx1], v2 = newv[idx2];
-                // accumulate values into corresponding positions
-                spmat_values[cidx][getKey(v1, v1)] += texel.barycentrics[idx1] * texel.barycentrics[idx1];
-                spmat_values[cidx][getKey(v2, v2)] += texel.barycentrics[idx2] * texel.barycentrics[idx2];
-                double val = texel.barycentrics[idx1] * texel.barycentrics[idx2];
-                spmat_values[cidx][getKey(v2, v1)] += val;
-                spmat_values[cidx][getKey(v1, v2)] += val;
-                Vector3d qv = q - texel.barycentrics[idx_in_face] * vertices_[fixed_vidx].opt_pt3;
-                for (int i = 0; i < 3; ++i)
+                if (!isTexelInPyramidLevel(t))
+                    continue;
+                const Vector3d& pt3_global = texels_.pt3_global[t];
+                double dis_pt2plane = pt3_global.dot(kNormal) + kW;
+                texels_.pt3_proj[t] = pt3_global - dis_pt2plane * kNormal;
+                bool flag_run_color_opt = false;
+                for (int k = texel_frame_offsets_[t]; k < texel_frame_offsets_[t + 1]; ++k)
+                {
+                    TexelProjection proj;
+                    if (!projectTexelToCachedFrame(texels_.pt3_proj[t], k, proj.pt3_local, proj.pt2_color))
+                        continue;
+                    proj.texel_idx = t;
+                    proj.frame_idx = texel_frames_[k];
+                    projections.push_back(proj);
+                    flag_run_color_opt = true;
+                }
+                if (flag_run_color_opt)
                 {
-                    JTRs[cidx](v1, i) += texel.barycentrics[idx1] * qv[i];
-                    JTRs[cidx](v2, i) += texel.barycentrics[idx2] * qv[i];
+                    Vector4d jrow_plane(pt3_global[0], pt3_global[1], pt3_global[2], 1);
+                    task.bv_plane += jrow_plane * dis_pt2plane;
+                    task.V_plane.triangularView<Upper>() += jrow_plane * jrow_plane.transpose();
+                    task.energy2 += dis_pt2plane * dis_pt2plane;
+                    task.is_optimized = true;
                 }
             }
-            else
+            sampleTexelProjections(projections, pts, grays, grads);
+            // Projections are sorted by frame, so the blocks of a task are in frame order
+            task.frame_blocks.clear();
+            for (size_t i = 0; i < projections.size(); ++i)
             {
-                // This is the common case that 3 vertices of the face do not contain the fixed vertex.
-                for (int i = 0; i < 3; ++i)
+                const TexelProjection& proj = projections[i];
+                int fidx = proj.frame_idx;
+                if (frame_slots[fidx] == -1)
                 {
-                    for (int j = i; j < 3; ++j)  // note that j >= i here
-                    {
-                        double val = texel.barycentrics[i] * texel.barycentrics[j];
-                        spmat_values[cidx][getKey(newv[i], newv[j])] += val;
-                        if (i != j)  // symmetric matrix
-                            spmat_values[cidx][getKey(newv[j], newv[i])] += val;
-                    }
+                    frame_slots[fidx] = int(task.frame_blocks.size());
+                    TaskFrameBlock block;
+                    block.frame_idx = fidx;
+                    block.U.setZero();
+                    block.bu.setZero();
+                    block.W.setZero();
+                    task.frame_blocks.push_back(block);
                 }
-                for (int i = 0; i < 3; ++i)
-                    for (int j = 0; j < 3; ++j)
-                        JTRs[cidx](newv[i], j) += texel.barycentrics[i] * q[j];
+                TaskFrameBlock& block = task.frame_blocks[frame_slots[fidx]];
+                const Vector3d& pt3_global = texels_.pt3_global[proj.texel_idx];
+                double dis_pt2plane = pt3_global.dot(kNormal) + kW;
+                // Jacobians of the color difference w.r.t. delta pose and plane, same as in pose and plane opt
+                double x = proj.pt3_local[0], y = proj.pt3_local[1], z = proj.pt3_local[2];
+                m13[0] = grads[i][0] * color_calib_.fx / z;
+                m13[1] = grads[i][1] * color_calib_.fy / z;
+                m13[2] = -(m13[0] * x + m13[1] * y) / z;
+                jrow[0] = -m13[1] * z + m13[2] * y;
+                jrow[1] = m13[0] * z - m13[2] * x;
+                jrow[2] = -m13[0] * y + m13[1] * x;
+                jrow.tail<3>() = m13.transpose();
+                Vector3d Rjni = frames_[fidx].opt_inv_R * kNormal;
+                m34.leftCols<3>() = -Rjni * pt3_global.transpose() - dis_pt2plane * frames_[fidx].opt_inv_R;
+                m34.col(3) = -Rjni;
+                m14.noalias() = m13 * m34;
+                double r = grays[i] - texels_.opt_graycolor[proj.texel_idx];
+                double weight = computeRobustWeight(r);
+                block.bu += jrow * (weight * r);
+                block.U.triangularView<Upper>() += weight * jrow * jrow.transpose();
+                block.W.noalias() += (weight * jrow) * m14;
+                task.bv += m14.transpose() * (weight * r);
+                task.V.triangularView<Upper>() += weight * m14.transpose() * m14;
+                task.energy1 += computeRobustLoss(r);
             }
+            for (const TaskFrameBlock& block : task.frame_blocks)
+                frame_slots[block.frame_idx] = -1;
         }
     }
-    // Create regularization/Laplacian term of Jacobian matrix
-    for (int cidx = 0; cidx < kComponentNum; ++cidx)
+    // Merge results of all tasks in a fixed order
+    system.energy1 = system.energy2 = 0;
+    for (const JointOptTask& task : tasks)
+    {
+        system.energy1 += task.energy1;
+        system.energy2 += task.energy2;
+    }
+    if (lambda1_ == 0 && system.energy2 != 0)
+        lambda1_ = system.energy1 / system.energy2;
+    system.U.assign(frame_num_, Matrix6d::Zero());
+    system.bu.assign(frame_num_, Vector6d::Zero());
+    system.V.assign(cluster_num_, Matrix4d::Zero());
+    system.bv.assign(cluster_num_, Vector4d::Zero());
+    system.is_cluster_optimized.assign(cluster_num_, 0);
+    system.blocks.clear();
+    unordered_map<long long, int> block_positions;  // frame_idx * cluster_num_ + cluster_idx -> position in blocks
+    for (const JointOptTask& task : tasks)
     {
-        for (int vidx : connected_components_[cidx])
+        int cidx = patches_[task.patch_idx].cluster_id;
+        system.V[cidx] += task.V + lambda1_ * task.V_plane;
+        system.bv[cidx] += task.bv + lambda1_ * task.bv_plane;
+        if (task.is_optimized)
+            system.is_cluster_optimized[cidx] = 1;
+        for (const TaskFrameBlock& block : task.frame_blocks)
         {
-            int n = int(vertices_[vidx].nbr_vertices.size());
-            if (n == 0)
-            {
-                PRINT_YELLOW("WARNING: vertex %d has no neighbors in the mesh. This is bad.", vidx);
-                continue;
-            }
-            double c0 = 1, c1 = -1.0 / n, c2 = 1.0 / (n * n);
-            vector<int> indices;
-            indices.push_back(vertices_[vidx].component_id_y);
-            bool flag_with_fixed_vertex = false;
-            for (int nvidx : vertices_[vidx].nbr_vertices)
-            {
-                if (nvidx == component_vertices[cidx])
-                    flag_with_fixed_vertex = true;
-                else
-                    indices.push_back(vertices_[nvidx].component_id_y);
-            }
-            for (size_t i = 0; i < indices.size(); ++i)
+            system.U[block.frame_idx] += block.U;
+            system.bu[block.frame_idx] += block.bu;
+            long long key = (long long)block.frame_idx * cluster_num_ + cidx;
+            auto it = block_positions.find(key);
+            if (it == block_positions.end())
             {
-                for (size_t j = 0; j < indices.size(); ++j)
-                {
-                    if (i == 0 && j == 0)
-                        spmat_values[cidx][getKey(indices[i], indices[j])] += c0;
-                    else if (i == 0 || j == 0)
-                        spmat_values[cidx][getKey(indices[i], indices[j])] += c1;
-                    else
-                        spmat_values[cidx][getKey(indices[i], indices[j])] += c2;
-                }
-            }
-            if (flag_with_fixed_vertex)
-            {
-                // For neighbors of the fixed vertex in the connected component,
-                // the Laplacian term will be like ||LX - D|| with D matrix non-zero
-                // for rows of the fixed vertex's neighbors.
-                Vector3d q = vertices_[component_vertices[cidx]].opt_pt3 / n;
-                for (size_t i = 0; i < indices.size(); ++i)
-                {
-                    for (size_t j = 0; j < 3; ++j)
-                    {
-                        if (i == 0)
-                            JTRs[cidx](indices[i], j) += q[j];
-                        else
-                            JTRs[cidx](indices[i], j) -= q[j] / n;
-                    }
-                }
+                block_positions[key] = int(system.blocks.size());
+                system.blocks.push_back({block.frame_idx, cidx, block.W});
             }
+            else
+                system.blocks[it->second].W += block.W;
         }
     }
-    // Solve linear system
-    cout << "Solving linear system for each component ..." << endl;
-    for (int i = 0; i < kComponentNum; ++i)
-    {
-        int n = int(connected_components_[i].size());
-        SparseMatrix<double> JTJ(n, n);
-        vector<Triplet<double>> triples;
-        triples.reserve(spmat_values[i].size());
-        for (auto it : spmat_values[i])
-        {
-            int x, y;
-            getPair(it.first, x, y);
-            triples.push_back(Triplet<double>(x, y, it.second));
-        }
-        JTJ.setFromTriplets(triples.begin(), triples.end());
-        SimplicialLLT<SparseMatrix<double>> solver;
-        solver.compute(JTJ);
-        if (solver.info() != Eigen::Success)
-        {
-            PRINT_YELLOW("WARNING: Failed to create solver for component %d", i);
+    std::sort(system.blocks.begin(), system.blocks.end(), [](const JointSystem::Block& a, const JointSystem::Block& b) {
+        return a.cluster_idx < b.cluster_idx || (a.cluster_idx == b.cluster_idx && a.frame_idx < b.frame_idx);
+    });
+}
+
+//! Solve the damped joint system by the Schur complement on planes.
+/*!
+    Each diagonal entry is increased by 'damping' times itself (at least 1e-6, so that frames and planes without
+    observations stay fixed). Plane blocks are eliminated: (U - W V^-1 W^T) pose_deltas = -bu + W V^-1 bv, and then
+    plane_deltas = -V^-1 (bv + W^T pose_deltas) per plane. The reduced system is symmetric 6N x 6N for N frames, whose
+    6x6 block (f, g) is non-zero only if frames f and g observe a same plane. It's solved densely for a few frames,
+    otherwise as a sparse matrix, whose sparsity pattern and symbolic factorization are reused while the pattern
+    (i.e. which frames observe which planes) does not change. 'predicted_decrease' is the decrease of the quadratic
+    model. Returns false if the reduced system cannot be factorized.
+*/
+bool RGBDMeshOpt::solveJointSystem(const JointSystem& system, double damping, vector<Vector6d>& pose_deltas,
+    vector<Vector4d>& plane_deltas, double& predicted_decrease)
+{
+    const double kMinDiagonal = 1e-6;
+    const int kBlockNum = int(system.blocks.size());
+    // Damped and inverted plane blocks. Planes without observations or with a singular block are kept fixed.
+    vector<Matrix4d> V_inv(cluster_num_, Matrix4d::Zero());
+    vector<Vector4d> V_damp(cluster_num_, Vector4d::Zero());
+#pragma omp parallel for schedule(static)
+    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+    {
+        if (!system.is_cluster_optimized[cidx])
             continue;
+        Matrix4d V = system.V[cidx].selfadjointView<Upper>();
+        for (int i = 0; i < 4; ++i)
+        {
+            V_damp[cidx][i] = damping * std::max(V(i, i), kMinDiagonal);
+            V(i, i) += V_damp[cidx][i];
         }
-        MatrixXd X(n, 3);
-        X = solver.solve(JTRs[i]);
-        for (int j = 0; j < n; ++j)
+        LLT<Matrix4d> llt(V);
+        if (llt.info() == Success)
+            V_inv[cidx] = llt.solve(Matrix4d::Identity());
+    }
+    // Blocks of each cluster are contiguous, and the blocks of each frame are listed for the reduced system
+    vector<int> cluster_block_offsets(cluster_num_ + 1, 0);
+    vector<vector<int>> frame_blocks(frame_num_);
+    for (int i = 0; i < kBlockNum; ++i)
+    {
+        ++cluster_block_offsets[system.blocks[i].cluster_idx + 1];
+        frame_blocks[system.blocks[i].frame_idx].push_back(i);
+    }
+    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+        cluster_block_offsets[cidx + 1] += cluster_block_offsets[cidx];
+    vector<Matrix64d> WV_inv(kBlockNum);
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < kBlockNum; ++i)
+        WV_inv[i].noalias() = system.blocks[i].W * V_inv[system.blocks[i].cluster_idx];
+
+    // Block rows of the reduced system, only the lower triangular part. Frame f is coupled with frame g <= f if they
+    // observe a same plane, and the blocks of row f are sorted by g. Each frame computes its own block row in parallel.
+    const int kDim = 6 * frame_num_;
+    vector<vector<int>> row_frames(frame_num_);
+    vector<vector<Matrix6d>> row_blocks(frame_num_);
+    VectorXd rhs(kDim);
+    vector<Vector6d> U_damp(frame_num_);
+#pragma omp parallel
+    {
+        vector<int> slots(frame_num_, -1);  // position of each frame in the current block row
+        vector<int> order;
+        vector<Matrix6d> blocks;
+#pragma omp for schedule(dynamic, 1)
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
+        {
+            Matrix6d U = system.U[fidx].selfadjointView<Upper>();
+            for (int i = 0; i < 6; ++i)
+            {
+                U_damp[fidx][i] = damping * std::max(U(i, i), kMinDiagonal);
+                U(i, i) += U_damp[fidx][i];
+            }
+            vector<int>& frames = row_frames[fidx];
+            frames.assign(1, fidx);
+            blocks.assign(1, U);
+            slots[fidx] = 0;
+            Vector6d b = -system.bu[fidx];
+            for (int i : frame_blocks[fidx])
+            {
+                int cidx = system.blocks[i].cluster_idx;
+                b += WV_inv[i] * system.bv[cidx];
+                for (int j = cluster_block_offsets[cidx]; j < cluster_block_offsets[cidx + 1]; ++j)
+                {
+                    int other_fidx = system.blocks[j].frame_idx;
+                    if (other_fidx > fidx)
+                        break;  // upper triangular part
+                    if (slots[other_fidx] == -1)
+                    {
+                        slots[other_fidx] = int(frames.size());
+                        frames.push_back(other_fidx);
+                        blocks.push_back(Matrix6d::Zero());
+                    }
+                    blocks[slots[other_fidx]].noalias() -= WV_inv[i] * system.blocks[j].W.transpose();
+                }
+            }
+            rhs.segment<6>(6 * fidx) = b;
+            order.resize(frames.size());
+            for (int k = 0; k < int(order.size()); ++k)
+            {
+                order[k] = k;
+                slots[frames[k]] = -1;
+            }
+            std::sort(order.begin(), order.end(), [&](int k1, int k2) { return frames[k1] < frames[k2]; });
+            vector<int> sorted_frames(order.size());
+            row_blocks[fidx].resize(order.size());
+            for (int k = 0; k < int(order.size()); ++k)
+            {
+                sorted_frames[k] = frames[order[k]];
+                row_blocks[fidx][k] = blocks[order[k]];
+            }
+            frames.swap(sorted_frames);
+        }
+    }
+    VectorXd X;
+    if (frame_num_ < FLAGS_joint_opt_dense_frame_number)
+    {
+        MatrixXd S = MatrixXd::Zero(kDim, kDim);
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
+        {
+            for (size_t k = 0; k < row_frames[fidx].size(); ++k)
+                S.block<6, 6>(6 * fidx, 6 * row_frames[fidx][k]) = row_blocks[fidx][k];
+        }
+        LLT<MatrixXd, Lower> llt(S);
+        if (llt.info() != Success)
+            return false;
+        X = llt.solve(rhs);
+    }
+    else
+    {
+        ReducedPoseSystem& reduced = reduced_pose_system_;
+        vector<int> row_offsets(frame_num_ + 1, 0);
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
+            row_offsets[fidx + 1] = row_offsets[fidx] + int(row_frames[fidx].size());
+        bool flag_same_pattern = reduced.solver && reduced.row_offsets == row_offsets;
+        for (int fidx = 0; fidx < frame_num_ && flag_same_pattern; ++fidx)
+        {
+            flag_same_pattern = std::equal(
+                row_frames[fidx].begin(), row_frames[fidx].end(), reduced.row_frames.begin() + row_offsets[fidx]);
+        }
+        if (!flag_same_pattern)
+        {
+            // Observations changed, so create the sparsity pattern and its symbolic factorization again
+            vector<Triplet<double>> pattern;
+            reduced.row_frames.clear();
+            for (int fidx = 0; fidx < frame_num_; ++fidx)
+            {
+                for (int other_fidx : row_frames[fidx])
+                {
+                    reduced.row_frames.push_back(other_fidx);
+                    for (int a = 0; a < 6; ++a)
+                    {
+                        for (int b = 0; b < ((other_fidx == fidx) ? a + 1 : 6); ++b)
+                            pattern.push_back(Triplet<double>(6 * fidx + a, 6 * other_fidx + b, 0));
+                    }
+                }
+            }
+            reduced.row_offsets = row_offsets;
+            reduced.S.resize(kDim, kDim);
+            reduced.S.setFromTriplets(pattern.begin(), pattern.end());  // zeros are kept in the pattern
+            reduced.solver.reset(new SimplicialLDLT<SparseMatrix<double>, Lower>());
+            reduced.solver->analyzePattern(reduced.S);
+        }
+        std::fill(reduced.S.valuePtr(), reduced.S.valuePtr() + reduced.S.nonZeros(), 0.0);
+        // Each block row writes its own entries, so rows are filled in parallel
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int fidx = 0; fidx < frame_num_; ++fidx)
+        {
+            for (size_t k = 0; k < row_frames[fidx].size(); ++k)
+            {
+                int other_fidx = row_frames[fidx][k];
+                const Matrix6d& block = row_blocks[fidx][k];
+                for (int a = 0; a < 6; ++a)
+                {
+                    for (int b = 0; b < ((other_fidx == fidx) ? a + 1 : 6); ++b)
+                        addToSymmetricSparseEntry(reduced.S, 6 * fidx + a, 6 * other_fidx + b, block(a, b));
+                }
+            }
+        }
+        reduced.solver->factorize(reduced.S);
+        if (reduced.solver->info() != Success)
+            return false;
+        X = reduced.solver->solve(rhs);
+    }
+    if (!X.allFinite())
+        return false;
+    pose_deltas.resize(frame_num_);
+    for (int fidx = 0; fidx < frame_num_; ++fidx)
+        pose_deltas[fidx] = X.segment<6>(6 * fidx);
+    plane_deltas.assign(cluster_num_, Vector4d::Zero());
+#pragma omp parallel for schedule(static)
+    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+    {
+        if (!system.is_cluster_optimized[cidx])
+            continue;
+        Vector4d b = system.bv[cidx];
+        for (int i = cluster_block_offsets[cidx]; i < cluster_block_offsets[cidx + 1]; ++i)
+            b.noalias() += system.blocks[i].W.transpose() * pose_deltas[system.blocks[i].frame_idx];
+        plane_deltas[cidx] = -V_inv[cidx] * b;
+    }
+    // Decrease of the quadratic model: 0.5 * delta^T (D * delta - b), D is the added damping
+    predicted_decrease = 0;
+    for (int fidx = 0; fidx < frame_num_; ++fidx)
+    {
+        const Vector6d& delta = pose_deltas[fidx];
+        predicted_decrease += 0.5 * (delta.dot(U_damp[fidx].cwiseProduct(delta)) - delta.dot(system.bu[fidx]));
+    }
+    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+    {
+        const Vector4d& delta = plane_deltas[cidx];
+        predicted_decrease += 0.5 * (delta.dot(V_damp[cidx].cwiseProduct(delta)) - delta.dot(system.bv[cidx]));
+    }
+    return std::isfinite(predicted_decrease);
+}
+
+//! Get all connected components of the mesh by BFS. Result is in 'connected_components_'.
+void RGBDMeshOpt::getConnectedComponents()
+{
+    connected_components_.clear();
+    for (int i = 0; i < vertex_num_; ++i)
+        vertices_[i].is_visited = false;
+    queue<int> qu;
+    for (int i = 0; i < vertex_num_; ++i)
+    {
+        if (vertices_[i].is_visited)
+            continue;
+        qu.push(i);
+        vertices_[i].is_visited = true;
+        vector<int> vset;
+        while (!qu.empty())
+        {
+            int v = qu.front();
+            qu.pop();
+            vset.push_back(v);
+            for (int nv : vertices_[v].nbr_vertices)
+            {
+                if (!vertices_[nv].is_visited)
+                {
+                    vertices_[nv].is_visited = true;
+                    qu.push(nv);
+                }
+            }
+        }
+        connected_components_.push_back(std::move(vset));
+    }
+}
+
+//! Create the linear system of each connected component for geometry optimization, which only depends on the mesh
+//! connectivity, so it's created once and reused by later runs.
+/*!
+    JTJ of a component has non-zeros only between vertices within 2 rings of each other: the data term couples
+    vertices of the same face, and the Laplacian term couples neighbors of the same vertex. So the sparsity pattern
+    (lower triangular part of the symmetric JTJ) is created from the 2-ring neighbors, and its symbolic
+    factorization is done only once here. Each run then only fills values and factorizes numerically.
+*/
+void RGBDMeshOpt::initGeometrySystems()
+{
+    if (!geometry_systems_.empty())
+        return;
+    // Get connected components and run optimization per component, since we need to
+    // ensure all vertices to be optimized are connected.
+    getConnectedComponents();
+
+    // In order to ensure that Laplacian matrix is full-rank (non-sigular),
+    // we fix the position of one single vertex for each connected component.
+    // Here we use the first vertex in each connected component.
+    const int kComponentNum = int(connected_components_.size());
+    component_fixed_vertices_.clear();
+    for (int i = 0; i < kComponentNum; ++i)
+    {
+        int vidx = connected_components_[i][0];
+        component_fixed_vertices_.push_back(vidx);
+        vertices_[vidx].component_id_x = i;
+        connected_components_[i].erase(connected_components_[i].begin());
+    }
+    // Save each vertex's position in connected components
+    for (int i = 0; i < kComponentNum; ++i)
+    {
+        for (int j = 0; j < int(connected_components_[i].size()); ++j)
         {
             int vidx = connected_components_[i][j];
-            for (int k = 0; k < 3; ++k)
-                vertices_[vidx].opt_pt3[k] = X(j, k);
+            vertices_[vidx].component_id_x = i;
+            vertices_[vidx].component_id_y = j;
+        }
+    }
+    geometry_systems_.resize(kComponentNum);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int cidx = 0; cidx < kComponentNum; ++cidx)
+    {
+        const int kFixedVertex = component_fixed_vertices_[cidx];
+        const int n = int(connected_components_[cidx].size());
+        if (FLAGS_geometry_cg_vertex_number > 0 && n >= FLAGS_geometry_cg_vertex_number)
+            continue;  // solved by 'solveGeometryByCG()' without JTJ
+        vector<Triplet<double>> pattern;
+        vector<int> rows;
+        for (int col = 0; col < n; ++col)
+        {
+            int vidx = connected_components_[cidx][col];
+            rows.clear();
+            rows.push_back(col);
+            for (int nv : vertices_[vidx].nbr_vertices)
+            {
+                if (nv != kFixedVertex)
+                    rows.push_back(vertices_[nv].component_id_y);
+                for (int nnv : vertices_[nv].nbr_vertices)
+                {
+                    if (nnv != kFixedVertex)
+                        rows.push_back(vertices_[nnv].component_id_y);
+                }
+            }
+            std::sort(rows.begin(), rows.end());
+            rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+            for (int row : rows)
+            {
+                if (row >= col)
+                    pattern.push_back(Triplet<double>(row, col, 0));
+            }
+        }
+        GeometrySystem& system = geometry_systems_[cidx];
+        system.JTJ.resize(n, n);
+        system.JTJ.setFromTriplets(pattern.begin(), pattern.end());  // zeros are kept in the pattern
+        system.solver.reset(new SimplicialLLT<SparseMatrix<double>, Lower>());
+        system.solver->analyzePattern(system.JTJ);
+    }
+}
+
+//! Add a value to entry (row, col) and (col, row) of symmetric 'mat', whose lower triangular part is saved.
+//! The entry must be in the sparsity pattern of 'mat'.
+void RGBDMeshOpt::addToSymmetricSparseEntry(SparseMatrix<double>& mat, int row, int col, double val)
+{
+    if (row < col)
+        std::swap(row, col);
+    const int* inner = mat.innerIndexPtr();
+    const int* it = std::lower_bound(inner + mat.outerIndexPtr()[col], inner + mat.outerIndexPtr()[col + 1], row);
+    mat.valuePtr()[it - inner] += val;
+}
+
+//! Optimize vertex positions so that texels are close to their planes while the mesh stays smooth (Laplacian).
+//! Components are independent linear systems, so small components are filled, factorized and solved in parallel,
+//! then large components (if 'geometry_cg_vertex_number' > 0) are solved one by one by parallel conjugate gradient.
+void RGBDMeshOpt::runMeshGeometryOpt()
+{
+    initGeometrySystems();
+    const int kComponentNum = int(connected_components_.size());
+    // Texels of each component, in texel order
+    vector<vector<int>> component_texels(kComponentNum);
+    for (int t = 0; t < texels_.size(); ++t)
+    {
+        int fa = texels_.face_id[t];
+        if (fa != -1)
+            component_texels[vertices_[faces_[fa].indices[0]].component_id_x].push_back(t);
+    }
+    vector<int> cg_components;
+    for (int cidx = 0; cidx < kComponentNum; ++cidx)
+    {
+        if (!geometry_systems_[cidx].solver)
+            cg_components.push_back(cidx);
+    }
+
+    cout << "Computing Jacobian and solving linear system for each component ..." << endl;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int cidx = 0; cidx < kComponentNum; ++cidx)
+    {
+        GeometrySystem& system = geometry_systems_[cidx];
+        if (!system.solver)
+            continue;
+        MatrixXd JTR;
+        fillGeometrySystem(cidx, component_texels[cidx], &system.JTJ, JTR);
+        // Solve linear system, reusing the symbolic factorization
+        system.solver->factorize(system.JTJ);
+        if (system.solver->info() != Eigen::Success)
+        {
+#pragma omp critical(print)
+            PRINT_YELLOW("WARNING: Failed to create solver for component %d", cidx);
+            continue;
         }
+        MatrixXd X = system.solver->solve(JTR);
+        for (int j = 0; j < X.rows(); ++j)
+            vertices_[connected_components_[cidx][j]].opt_pt3 = X.row(j).transpose();
+    }
+    for (int cidx : cg_components)
+    {
+        MatrixXd JTR;
+        fillGeometrySystem(cidx, component_texels[cidx], nullptr, JTR);
+        solveGeometryByCG(cidx, component_texels[cidx], JTR);
     }
     cout << "DONE." << endl;
 }
 
+//! Compute JTr (and JTJ if not null, whose pattern is created by 'initGeometrySystems()') of a component from its
+//! texels and Laplacian term.
+void RGBDMeshOpt::fillGeometrySystem(int cidx, const vector<int>& texels, SparseMatrix<double>* JTJ, MatrixXd& JTR)
+{
+    const int n = int(connected_components_[cidx].size());
+    const int kFixedVertex = component_fixed_vertices_[cidx];
+    if (JTJ)
+        std::fill(JTJ->valuePtr(), JTJ->valuePtr() + JTJ->nonZeros(), 0.0);
+    JTR = MatrixXd::Zero(n, 3);
+
+    /// Create geometry term of Jacobian matrix
+    int oldv[3], newv[3];  // original vertex index and new index in Jacobian matrix
+    for (int t : texels)
+    {
+        int fa = texels_.face_id[t];
+        const Vector3d& q = texels_.pt3_proj[t];
+        const Vector3d& barycentrics = texels_.barycentrics[t];
+
+        // Check if the face contains the fixed vertex in the component
+        int idx_in_face = -1;
+        for (int i = 0; i < 3; ++i)
+        {
+            oldv[i] = faces_[fa].indices[i];
+            newv[i] = vertices_[oldv[i]].component_id_y;
+            if (oldv[i] == kFixedVertex)
+                idx_in_face = i;
+        }
+        if (idx_in_face != -1)
+        {
+            // This is the special case that one vertex of the face is the fixed vertex in
+            // the connected component. We need to deal with this specifically.
+            int idx1 = (idx_in_face + 1) % 3, idx2 = (idx_in_face + 2) % 3;
+            int v1 = newv[idx1], v2 = newv[idx2];
+            // accumulate values into corresponding positions
+            if (JTJ)
+            {
+                addToSymmetricSparseEntry(*JTJ, v1, v1, barycentrics[idx1] * barycentrics[idx1]);
+                addToSymmetricSparseEntry(*JTJ, v2, v2, barycentrics[idx2] * barycentrics[idx2]);
+                addToSymmetricSparseEntry(*JTJ, v1, v2, barycentrics[idx1] * barycentrics[idx2]);
+            }
+            Vector3d qv = q - barycentrics[idx_in_face] * vertices_[kFixedVertex].opt_pt3;
+            for (int i = 0; i < 3; ++i)
+            {
+                JTR(v1, i) += barycentrics[idx1] * qv[i];
+                JTR(v2, i) += barycentrics[idx2] * qv[i];
+            }
+        }
+        else
+        {
+            // This is the common case that 3 vertices of the face do not contain the fixed vertex.
+            for (int i = 0; i < 3 && JTJ; ++i)
+            {
+                for (int j = i; j < 3; ++j)  // note that j >= i here, symmetric matrix
+                    addToSymmetricSparseEntry(*JTJ, newv[i], newv[j], barycentrics[i] * barycentrics[j]);
+            }
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 3; ++j)
+                    JTR(newv[i], j) += barycentrics[i] * q[j];
+        }
+    }
+
+    /// Create regularization/Laplacian term of Jacobian matrix
+    vector<int> indices;
+    for (int vidx : connected_components_[cidx])
+    {
+        int nbr_num = int(vertices_[vidx].nbr_vertices.size());
+        if (nbr_num == 0)
+        {
+#pragma omp critical(print)
+            PRINT_YELLOW("WARNING: vertex %d has no neighbors in the mesh. This is bad.", vidx);
+            continue;
+        }
+        double c0 = 1, c1 = -1.0 / nbr_num, c2 = 1.0 / (nbr_num * nbr_num);
+        indices.clear();
+        indices.push_back(vertices_[vidx].component_id_y);
+        bool flag_with_fixed_vertex = false;
+        for (int nvidx : vertices_[vidx].nbr_vertices)
+        {
+            if (nvidx == kFixedVertex)
+                flag_with_fixed_vertex = true;
+            else
+                indices.push_back(vertices_[nvidx].component_id_y);
+        }
+        for (size_t i = 0; i < indices.size() && JTJ; ++i)
+        {
+            for (size_t j = i; j < indices.size(); ++j)  // symmetric matrix
+            {
+                if (i == 0 && j == 0)
+                    addToSymmetricSparseEntry(*JTJ, indices[i], indices[j], c0);
+                else if (i == 0)
+                    addToSymmetricSparseEntry(*JTJ, indices[i], indices[j], c1);
+                else
+                    addToSymmetricSparseEntry(*JTJ, indices[i], indices[j], c2);
+            }
+        }
+        if (flag_with_fixed_vertex)
+        {
+            // For neighbors of the fixed vertex in the connected component,
+            // the Laplacian term will be like ||LX - D|| with D matrix non-zero
+            // for rows of the fixed vertex's neighbors.
+            Vector3d q = vertices_[kFixedVertex].opt_pt3 / nbr_num;
+            for (size_t i = 0; i < indices.size(); ++i)
+            {
+                for (size_t j = 0; j < 3; ++j)
+                {
+                    if (i == 0)
+                        JTR(indices[i], j) += q[j];
+                    else
+                        JTR(indices[i], j) -= q[j] / nbr_num;
+                }
+            }
+        }
+    }
+}
+
+//! Solve the geometry system of a component by matrix-free Jacobi-preconditioned conjugate gradient, which never
+//! creates JTJ. Return false if it doesn't converge in 'geometry_cg_max_iteration' iterations.
+/*!
+    JTJ = A^T * A + L^T * L, where each row of A is a texel (barycentric coordinates of its face vertices) and each
+    row of L is the Laplacian of a vertex. JTJ * X is applied by three gathers (texels, Laplacian rows, then each
+    vertex from its texels and neighbors), so it runs in parallel without write conflicts. The x, y and z columns
+    are solved together, starting from current vertex positions. Result is saved in 'opt_pt3' of the vertices.
+*/
+bool RGBDMeshOpt::solveGeometryByCG(int cidx, const vector<int>& texels, const MatrixXd& JTR)
+{
+    const vector<int>& kVertices = connected_components_[cidx];
+    const int n = int(kVertices.size());
+    const int kTexelNum = int(texels.size());
+    const int kFixedVertex = component_fixed_vertices_[cidx];
+
+    // Rows of A: 3 vertices (-1 for the fixed vertex) and weights of each texel
+    vector<int> texel_vertices(3 * kTexelNum);
+    vector<double> texel_weights(3 * kTexelNum);
+    vector<int> incidence_offsets(n + 1, 0);  // entries in A of each vertex, as positions in 'texel_vertices'
+    for (int k = 0; k < kTexelNum; ++k)
+    {
+        const Face& face = faces_[texels_.face_id[texels[k]]];
+        for (int i = 0; i < 3; ++i)
+        {
+            int v = (face.indices[i] == kFixedVertex) ? -1 : vertices_[face.indices[i]].component_id_y;
+            texel_vertices[3 * k + i] = v;
+            texel_weights[3 * k + i] = texels_.barycentrics[texels[k]][i];
+            if (v != -1)
+                incidence_offsets[v + 1]++;
+        }
+    }
+    for (int j = 0; j < n; ++j)
+        incidence_offsets[j + 1] += incidence_offsets[j];
+    vector<int> incidence(incidence_offsets[n]), cursor(incidence_offsets.begin(), incidence_offsets.end() - 1);
+    for (int k = 0; k < 3 * kTexelNum; ++k)
+    {
+        if (texel_vertices[k] != -1)
+            incidence[cursor[texel_vertices[k]]++] = k;
+    }
+    // Rows of L: x_j - sum of neighbors / neighbor number. The fixed vertex is a constant in JTr.
+    vector<int> nbr_offsets(n + 1, 0), nbrs;
+    vector<double> inv_nbr_num(n, 0), has_row(n, 0);
+    for (int j = 0; j < n; ++j)
+    {
+        const unordered_set<int>& kNbrs = vertices_[kVertices[j]].nbr_vertices;
+        if (!kNbrs.empty())
+        {
+            inv_nbr_num[j] = 1.0 / kNbrs.size();
+            has_row[j] = 1;
+        }
+        for (int nv : kNbrs)
+        {
+            if (nv != kFixedVertex)
+                nbrs.push_back(vertices_[nv].component_id_y);
+        }
+        nbr_offsets[j + 1] = int(nbrs.size());
+    }
+
+    RowMatrixX3d S(kTexelNum, 3), R(n, 3);  // A * X and L * X
+    auto applyJTJ = [&](const RowMatrixX3d& X, RowMatrixX3d& Y) {
+#pragma omp parallel for schedule(static)
+        for (int k = 0; k < kTexelNum; ++k)
+        {
+            RowVector3d sum(0, 0, 0);
+            for (int i = 3 * k; i < 3 * k + 3; ++i)
+            {
+                if (texel_vertices[i] != -1)
+                    sum += texel_weights[i] * X.row(texel_vertices[i]);
+            }
+            S.row(k) = sum;
+        }
+#pragma omp parallel for schedule(static)
+        for (int j = 0; j < n; ++j)
+        {
+            RowVector3d sum(0, 0, 0);
+            for (int i = nbr_offsets[j]; i < nbr_offsets[j + 1]; ++i)
+                sum += X.row(nbrs[i]);
+            R.row(j) = has_row[j] * X.row(j) - inv_nbr_num[j] * sum;
+        }
+#pragma omp parallel for schedule(static)
+        for (int j = 0; j < n; ++j)
+        {
+            RowVector3d sum = has_row[j] * R.row(j);
+            for (int i = incidence_offsets[j]; i < incidence_offsets[j + 1]; ++i)
+                sum += texel_weights[incidence[i]] * S.row(incidence[i] / 3);
+            for (int i = nbr_offsets[j]; i < nbr_offsets[j + 1]; ++i)
+                sum -= inv_nbr_num[nbrs[i]] * R.row(nbrs[i]);
+            Y.row(j) = sum;
+        }
+    };
+    // Jacobi preconditioner: inverse of the diagonal of JTJ
+    VectorXd inv_diag(n);
+    for (int j = 0; j < n; ++j)
+    {
+        double diag = has_row[j];
+        for (int i = incidence_offsets[j]; i < incidence_offsets[j + 1]; ++i)
+            diag += texel_weights[incidence[i]] * texel_weights[incidence[i]];
+        for (int i = nbr_offsets[j]; i < nbr_offsets[j + 1]; ++i)
+            diag += inv_nbr_num[nbrs[i]] * inv_nbr_num[nbrs[i]];
+        inv_diag[j] = (diag > 0) ? 1.0 / diag : 0;
+    }
+
+    // Warm start from current vertex positions
+    RowMatrixX3d X(n, 3), B = JTR, AP(n, 3);
+    for (int j = 0; j < n; ++j)
+        X.row(j) = vertices_[kVertices[j]].opt_pt3.transpose();
+    applyJTJ(X, AP);
+    RowMatrixX3d Res = B - AP;
+    RowMatrixX3d Z = inv_diag.asDiagonal() * Res;
+    RowMatrixX3d P = Z;
+    Array3d rz = Res.cwiseProduct(Z).colwise().sum().transpose();
+    const Array3d kStopNorm = FLAGS_geometry_cg_tolerance * B.colwise().norm().transpose().array();
+    int iter = 0;
+    for (; iter < FLAGS_geometry_cg_max_iteration; ++iter)
+    {
+        if ((Res.colwise().norm().transpose().array() <= kStopNorm).all())
+            break;
+        applyJTJ(P, AP);
+        Array3d pAp = P.cwiseProduct(AP).colwise().sum().transpose();
+        Array3d alpha = (pAp > 0).select(rz / pAp, 0);
+        X += P * alpha.matrix().asDiagonal();
+        Res -= AP * alpha.matrix().asDiagonal();
+        Z = inv_diag.asDiagonal() * Res;
+        Array3d rz_new = Res.cwiseProduct(Z).colwise().sum().transpose();
+        Array3d beta = (rz > 0).select(rz_new / rz, 0);
+        P = Z + P * beta.matrix().asDiagonal();
+        rz = rz_new;
+    }
+    for (int j = 0; j < n; ++j)
+        vertices_[kVertices[j]].opt_pt3 = X.row(j).transpose();
+    bool flag_converged = iter < FLAGS_geometry_cg_max_iteration;
+    if (!flag_converged)
+    {
+        PRINT_YELLOW("WARNING: conjugate gradient of component %d (%d vertices) doesn't converge in %d iterations.",
+                     cidx, n, iter);
+    }
+    else
+        cout << "Component " << cidx << " (" << n << " vertices) converged in " << iter << " CG iterations." << endl;
+    return flag_converged;
+}
+
 void RGBDMeshOpt::initAll()
 {
     initMeshConnectivity();
@@ -1356,8 +2359,6 @@ void RGBDMeshOpt::initClusters()
         clusters_[i].opt_center = clusters_[i].center = clusters_[i].cov.center_;
         clusters_[i].opt_w = clusters_[i].w;
 
-        clusters_[i].JTJ = MatrixXd(4, 4);
-        clusters_[i].JTr = MatrixXd(4, 1);
         clusters_[i].JTJ.setZero();
         clusters_[i].JTr.setZero();
     }
@@ -1366,8 +2367,8 @@ void RGBDMeshOpt::initClusters()
 void RGBDMeshOpt::initRGBDFrames()
 {
     cout << "Initialize RGBD frames." << endl;
-    assert(color_width_ == depth_width_ && color_height_ == depth_height_ && color_width_ == frames_[0].color_img.cols &&
-           color_height_ == frames_[0].color_img.rows);
+    assert(color_width_ == depth_width_ && color_height_ == depth_height_ && color_width_ == frames_[0].gray_img.cols &&
+           color_height_ == frames_[0].gray_img.rows);
 
     frame_num_ = static_cast<int>(frames_.size());
     for (int fridx = 0; fridx < frame_num_; ++fridx)
@@ -1383,20 +2384,32 @@ void RGBDMeshOpt::initRGBDFrames()
                 faces_[nbr].visible_frames.insert(fridx);
         }
 
-        // Compute color image pixel gradients
-        cv::cvtColor(frame.color_img, frame.gray_img, CV_RGB2GRAY);
-        frame.pixel_gradients.resize(color_height_, vector<Vector2d>(color_width_));
-        for (int y = 1; y < color_height_ - 1; ++y)  // exclude outmost border
+        // Compute color image pixel gradients by Scharr kernel, normalized to the same scale as gray color in [0, 1]
+        const double kGradientScale = 1.0 / (16 * 255);
+        cv::Scharr(frame.gray_img, frame.grad_x, CV_32F, 1, 0, kGradientScale);
+        cv::Scharr(frame.gray_img, frame.grad_y, CV_32F, 0, 1, kGradientScale);
+        for (cv::Mat* grad : {&frame.grad_x, &frame.grad_y})
         {
-            for (int x = 1; x < color_width_ - 1; ++x)
-            {
-                Vector2i u(x, y);
-                frame.pixel_gradients[y][x][0] = computePixelGraycolorGradient(u, fridx, kScharrKernelX);
-                frame.pixel_gradients[y][x][1] = computePixelGraycolorGradient(u, fridx, kScharrKernelY);
-            }
+            // Exclude outmost border
+            grad->row(0).setTo(0);
+            grad->row(color_height_ - 1).setTo(0);
+            grad->col(0).setTo(0);
+            grad->col(color_width_ - 1).setTo(0);
+        }
+        frame.gray_pyramid.assign(1, frame.gray_img);
+        frame.grad_x_pyramid.assign(1, frame.grad_x);
+        frame.grad_y_pyramid.assign(1, frame.grad_y);
+        for (int level = 1; level < FLAGS_pyramid_level_number; ++level)
+        {
+            cv::Mat gray, grad_x, grad_y;
+            cv::pyrDown(frame.gray_pyramid.back(), gray);
+            // Gradient of each level is in its own pixel unit, and will be scaled to full resolution when sampled
+            cv::Scharr(gray, grad_x, CV_32F, 1, 0, kGradientScale);
+            cv::Scharr(gray, grad_y, CV_32F, 0, 1, kGradientScale);
+            frame.gray_pyramid.push_back(gray);
+            frame.grad_x_pyramid.push_back(grad_x);
+            frame.grad_y_pyramid.push_back(grad_y);
         }
-        frame.JTJ = MatrixXd(6, 6);
-        frame.JTr = MatrixXd(6, 1);
         frame.JTJ.setZero();
         frame.JTr.setZero();
         frame.opt_T = frame.T;
@@ -1500,6 +2513,13 @@ void RGBDMeshOpt::createTexturePatches()
     }
 }
 
+//! Pack all patches into texture images by the MaxRects algorithm.
+/*!
+    Patches are packed from the largest to the smallest. Each patch goes into the first texture image that can hold
+    it, at the free position that leaves the shortest side (best short side fit), and with 'allow_patch_rotation' it
+    may be rotated by 90 degrees if that fits better. A new texture image is created only if no existing one can hold
+    the patch, and each texture image is finally cropped to the bounding box of its patches.
+*/
 void RGBDMeshOpt::packAllPatches()
 {
     // Used to sort the texture patch from largest area to smallest
@@ -1507,224 +2527,694 @@ void RGBDMeshOpt::packAllPatches()
         return t1.area > t2.area || (t1.area == t2.area && t1.height > t2.height);
     };
     std::sort(patches_.begin(), patches_.end(), TexturePatchComparator);
-    vector<std::unique_ptr<TreeNode>> roots;  // each root denotes one output texture image
+    vector<TextureAtlas> atlases;  // each atlas denotes one output texture image
     int img_width = FLAGS_texture_image_resolution, img_height = FLAGS_texture_image_resolution;
     for (TexturePatch& patch : patches_)
     {
-        int img_idx = 0;
-        if (patch.width > img_width || patch.height > img_height)
+        bool flag_fit = patch.width <= img_width && patch.height <= img_height;
+        bool flag_fit_rotated = FLAGS_allow_patch_rotation && patch.height <= img_width && patch.width <= img_height;
+        if (!flag_fit && !flag_fit_rotated)
         {
             PRINT_YELLOW(
                 "WARNING: patch size (%d, %d) is too large than default texture image width %d. Will enlarge the image.",
                 patch.width, patch.height, img_width);
             img_width = img_height = std::max(patch.width, patch.height);
         }
-        while (true)
+        int img_idx = 0;
+        cv::Rect rect;
+        for (; img_idx < int(atlases.size()); ++img_idx)
         {
-            if (img_idx == int(roots.size()))
-            {  // create new texture image if current images cannot hold the patch
-                std::unique_ptr<TreeNode> root(new TreeNode(0, 0, img_width, img_height));
-                roots.push_back(std::move(root));
-                cv::Mat texture_img(img_height, img_width, CV_8UC3, cv::Scalar(255, 255, 255));
-                texture_images_.push_back(std::move(texture_img));
-            }
-            if (packPatchRecursive(roots[img_idx], patch))
-            {  // Each patch is ensured to be packed in some texture image.
-                patch.texture_img_idx = img_idx;
+            if (findPatchPositionInAtlas(atlases[img_idx], patch, rect))
                 break;
-            }
-            img_idx++;
         }
-        // Compute final texture coordinates for all vertices in the patch
+        if (img_idx == int(atlases.size()))
+        {  // create new texture image if current images cannot hold the patch
+            TextureAtlas atlas;
+            atlas.width = img_width;
+            atlas.height = img_height;
+            atlas.free_rects.push_back(cv::Rect(0, 0, img_width, img_height));
+            atlas.max_free_width = img_width;
+            atlas.max_free_height = img_height;
+            atlas.used_width = atlas.used_height = 0;
+            atlases.push_back(std::move(atlas));
+            findPatchPositionInAtlas(atlases[img_idx], patch, rect);
+        }
+        if (rect.width != patch.width)
+            rotateTexturePatch(patch);
+        placeRectInAtlas(atlases[img_idx], rect);
+        patch.texture_img_idx = img_idx;
+        patch.blx = rect.x;  // Save patch corner point in texture image
+        patch.bly = rect.y;
+    }
+    // Patches are packed from the bottom-left corner, so the empty part on the top and right is cropped
+    for (const TextureAtlas& atlas : atlases)
+    {
+        cv::Mat texture_img(atlas.used_height, atlas.used_width, CV_8UC3, cv::Scalar(255, 255, 255));
+        texture_images_.push_back(std::move(texture_img));
+    }
+    // Compute final texture coordinates for all vertices in the patch
+    for (TexturePatch& patch : patches_)
+    {
+        const cv::Mat& texture_img = texture_images_[patch.texture_img_idx];
         for (size_t i = 0; i < patch.uv_textures.size(); ++i)
         {
-            patch.uv_textures[i][0] = (patch.uv_textures[i][0] * FLAGS_unit_meter_resolution + patch.blx) / img_width;
-            patch.uv_textures[i][1] = (patch.uv_textures[i][1] * FLAGS_unit_meter_resolution + patch.bly) / img_height;
+            patch.uv_textures[i][0] = (patch.uv_textures[i][0] * FLAGS_unit_meter_resolution + patch.blx) / texture_img.cols;
+            patch.uv_textures[i][1] = (patch.uv_textures[i][1] * FLAGS_unit_meter_resolution + patch.bly) / texture_img.rows;
         }
     }
-    cout << "#Texture images: " << texture_images_.size() << endl;
+    size_t used_area = 0, atlas_area = 0;
+    for (const TexturePatch& patch : patches_)
+        used_area += size_t(patch.area);
+    for (const cv::Mat& texture_img : texture_images_)
+        atlas_area += size_t(texture_img.cols) * texture_img.rows;
+    cout << "#Texture images: " << texture_images_.size() << ", fill ratio: " << double(used_area) / atlas_area << endl;
 }
 
-//! Pack each patch into the final texture images using binary split partition algorithm. Return true
-//! if the patch is successfully packed into the texture image, otherwise return false (such as texture
-//! image has no space to hold the patch, etc). Note that here we pack each patch into texture image
-//! from bottom-left in order to fit the texture coordinates, where bottom-left is (0,0) and top right is (1,1).
-//! Ref: https://slizerboy.wordpress.com/tag/texture-atlas/
-bool RGBDMeshOpt::packPatchRecursive(std::unique_ptr<TreeNode>& root, TexturePatch& patch)
+//! Find the position of a patch in a texture atlas by best short side fit. Return false if the atlas cannot hold it.
+//! 'rect' is the position, whose width and height are swapped from the patch if it is better to rotate the patch.
+bool RGBDMeshOpt::findPatchPositionInAtlas(const TextureAtlas& atlas, const TexturePatch& patch, cv::Rect& rect)
 {
-    if (root == nullptr)
-        return false;
-
-    // Traverse until meeting a leaf node with enough space to keep the patch
-    if (!root->is_leaf)
+    const int kSideNum = FLAGS_allow_patch_rotation ? 2 : 1;
+    int best_short_side = INT_MAX, best_long_side = INT_MAX;
+    for (int k = 0; k < kSideNum; ++k)
     {
-        if (packPatchRecursive(root->left, patch))
-            return true;
-        return packPatchRecursive(root->right, patch);
+        int w = (k == 0) ? patch.width : patch.height;
+        int h = (k == 0) ? patch.height : patch.width;
+        if (w > atlas.max_free_width || h > atlas.max_free_height)
+            continue;  // quickly skip a (nearly) full atlas
+        for (const cv::Rect& free_rect : atlas.free_rects)
+        {
+            if (w > free_rect.width || h > free_rect.height)
+                continue;
+            int dw = free_rect.width - w, dh = free_rect.height - h;
+            int short_side = std::min(dw, dh), long_side = std::max(dw, dh);
+            if (short_side < best_short_side || (short_side == best_short_side && long_side < best_long_side))
+            {
+                best_short_side = short_side;
+                best_long_side = long_side;
+                rect = cv::Rect(free_rect.x, free_rect.y, w, h);
+            }
+        }
     }
-    // The node space is not big enough to hold the patch
-    if (patch.width > root->width || patch.height > root->height)
-        return false;
+    return best_short_side != INT_MAX;
+}
 
-    // Split the node into two children nodes
-    root->left.reset(new TreeNode());        // left node holds current patch
-    root->left->left.reset(new TreeNode());  // left->left node fits current patch
-    // Update corners of root->left->right node and root->right node (they are still blank/leaf nodes).
-    // Note that root->right node's space is always larger than root->left->right node
-    if (root->width >= root->height)
+//! Occupy 'rect' in a texture atlas. Each free rectangle overlapping it is split into at most 4 maximal free
+//! rectangles around it, then new free rectangles inside any other free rectangle are removed.
+/*!
+    Free rectangles not split are never inside a new one (which is inside a split free rectangle), so only the
+    new free rectangles are checked, which is much cheaper than checking all pairs.
+*/
+void RGBDMeshOpt::placeRectInAtlas(TextureAtlas& atlas, const cv::Rect& rect)
+{
+    auto IsInside = [](const cv::Rect& a, const cv::Rect& b) {  // a is inside b
+        return a.x >= b.x && a.y >= b.y && a.x + a.width <= b.x + b.width && a.y + a.height <= b.y + b.height;
+    };
+    const int kRight = rect.x + rect.width, kTop = rect.y + rect.height;
+    vector<cv::Rect> kept_rects, new_rects;
+    for (const cv::Rect& f : atlas.free_rects)
     {
-        root->left->right.reset(new TreeNode(root->minx, root->miny + patch.height, patch.width, root->height - patch.height));
-        root->right.reset(new TreeNode(root->minx + patch.width, root->miny, root->width - patch.width, root->height));
+        int f_right = f.x + f.width, f_top = f.y + f.height;
+        if (rect.x >= f_right || kRight <= f.x || rect.y >= f_top || kTop <= f.y)
+        {
+            kept_rects.push_back(f);
+            continue;
+        }
+        if (rect.x > f.x)  // left part
+            new_rects.push_back(cv::Rect(f.x, f.y, rect.x - f.x, f.height));
+        if (kRight < f_right)  // right part
+            new_rects.push_back(cv::Rect(kRight, f.y, f_right - kRight, f.height));
+        if (rect.y > f.y)  // bottom part
+            new_rects.push_back(cv::Rect(f.x, f.y, f.width, rect.y - f.y));
+        if (kTop < f_top)  // top part
+            new_rects.push_back(cv::Rect(f.x, kTop, f.width, f_top - kTop));
     }
-    else
+    const int kNewNum = int(new_rects.size());
+    vector<bool> is_removed(kNewNum, false);
+    for (int i = 0; i < kNewNum; ++i)
+    {
+        for (const cv::Rect& f : kept_rects)
+        {
+            if (IsInside(new_rects[i], f))
+            {
+                is_removed[i] = true;
+                break;
+            }
+        }
+        for (int j = 0; j < kNewNum && !is_removed[i]; ++j)
+        {
+            // For identical rectangles, only the first one is kept
+            if (j != i && !is_removed[j] && IsInside(new_rects[i], new_rects[j]))
+                is_removed[i] = true;
+        }
+    }
+    for (int i = 0; i < kNewNum; ++i)
     {
-        root->left->right.reset(new TreeNode(root->minx + patch.width, root->miny, root->width - patch.width, patch.height));
-        root->right.reset(new TreeNode(root->minx, root->miny + patch.height, root->width, root->height - patch.height));
+        if (!is_removed[i])
+            kept_rects.push_back(new_rects[i]);
     }
-    root->is_leaf = false;   // Set the node as non-leaf
-    patch.blx = root->minx;  // Save patch corner point in texture image
-    patch.bly = root->miny;
-    return true;
+    atlas.free_rects.swap(kept_rects);
+    atlas.max_free_width = atlas.max_free_height = 0;
+    for (const cv::Rect& f : atlas.free_rects)
+    {
+        atlas.max_free_width = std::max(atlas.max_free_width, f.width);
+        atlas.max_free_height = std::max(atlas.max_free_height, f.height);
+    }
+    atlas.used_width = std::max(atlas.used_width, kRight);
+    atlas.used_height = std::max(atlas.used_height, kTop);
+}
+
+//! Rotate a patch by 90 degrees counterclockwise before it's packed, i.e. swap its width and height, and rotate the
+//! uv coordinates (in meters, with bottom-left corner as origin) of its vertices: (u, v) -> (height - v, u).
+void RGBDMeshOpt::rotateTexturePatch(TexturePatch& patch)
+{
+    const double kHeight = double(patch.height) / FLAGS_unit_meter_resolution;
+    for (Vector2d& uv : patch.uv_textures)
+        uv = Vector2d(kHeight - uv[1], uv[0]);
+    std::swap(patch.width, patch.height);
 }
 
+//! Patches are in disjoint rectangles of texture images, so texels of each patch are created in parallel and then
+//! concatenated in patch order. The result is the same as creating them patch by patch.
 void RGBDMeshOpt::computeTexelsForAllPatches()
 {
-    texels_.resize(texture_images_.size());
-    for (size_t i = 0; i < texture_images_.size(); ++i)
-        texels_[i].resize(texture_images_[i].rows, vector<Texel>(texture_images_[i].cols));
-    int texel_num = 0;
-    double c0 = 0, c1 = 0, c2 = 0;
-    for (TexturePatch& patch : patches_)
+    const int kPatchNum = int(patches_.size());
+    vector<TexelTable> patch_texels(kPatchNum);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int pidx = 0; pidx < kPatchNum; ++pidx)
+        rasterizePatchTexels(patches_[pidx], patch_texels[pidx]);
+
+    // Texel indices in 'texel_grid' are local to the patch until here
+    texels_.clear();
+    for (int pidx = 0; pidx < kPatchNum; ++pidx)
     {
-        int cidx = patch.cluster_id;
-        int tidx = patch.texture_img_idx;
-        int img_width = texture_images_[tidx].cols, img_height = texture_images_[tidx].rows;
-        for (int fidx : clusters_[cidx].faces)
+        TexturePatch& patch = patches_[pidx];
+        patch.texel_begin = texels_.size();
+        texels_.append(patch_texels[pidx], 0, patch_texels[pidx].size());
+        patch.texel_end = texels_.size();
+        for (int& t : patch.texel_grid)
         {
-            // Get bounding box for the face
-            Face& face = faces_[fidx];
-            Eigen::AlignedBox2d box;
-            for (int i = 0; i < 3; ++i)
+            if (t != -1)
+                t += patch.texel_begin;
+        }
+        patch_texels[pidx].clear();
+    }
+    cout << "#Texels: " << texels_.size() << endl;
+}
+
+//! Create texels of a patch into 'texels', and save their local indices (starting from 0) in the patch grid.
+/*!
+    Each face is rasterized by edge functions: barycentric coordinates are affine in the pixel position, so in each
+    row of the face bounding box they are a row start value plus a constant step per pixel. The inside test of a row
+    is a branchless loop which can be vectorized by the compiler, and only pixels inside the face are then checked
+    against the grid. A pixel shared by several faces belongs to the first face, same as before.
+*/
+void RGBDMeshOpt::rasterizePatchTexels(TexturePatch& patch, TexelTable& texels)
+{
+    int tidx = patch.texture_img_idx;
+    int img_width = texture_images_[tidx].cols, img_height = texture_images_[tidx].rows;
+    patch.texel_grid.assign((patch.width + 2) * (patch.height + 2), -1);
+    vector<double> row_c1, row_c2;
+    vector<unsigned char> row_inside;
+    for (int fidx : clusters_[patch.cluster_id].faces)
+    {
+        // Get bounding box for the face
+        Face& face = faces_[fidx];
+        Eigen::AlignedBox2d box;
+        for (int i = 0; i < 3; ++i)
+        {
+            int vidx = face.indices[i];
+            auto it = patch.vertex_to_patch.find(vidx);
+            if (it == patch.vertex_to_patch.end())
+            {
+#pragma omp critical(print)
+                PRINT_RED("ERROR: vertex %d is not saved in its patch. This shouldn't happen.", vidx);
+                continue;
+            }
+            // We already computed uv for each vertex in each cluster before.
+            face.uv[i] = patch.uv_textures[it->second];
+            face.uv[i][0] *= img_width;
+            face.uv[i][1] = img_height * (1.0 - face.uv[i][1]);
+            box.extend(face.uv[i]);
+        }
+        // Edge functions: c1 = (p - v0) x e2 / (e1 x e2), c2 = e1 x (p - v0) / (e1 x e2), c0 = 1 - c1 - c2
+        const Vector2d& v0 = face.uv[0];
+        Vector2d e1 = face.uv[1] - v0, e2 = face.uv[2] - v0;
+        double e12 = e1[0] * e2[1] - e1[1] * e2[0];
+        if (fabs(e12) < 1e-8)
+            continue;  // triangle is degenerate: two edges are almost colinear
+        double c1_dx = e2[1] / e12, c1_dy = -e2[0] / e12;
+        double c2_dx = -e1[1] / e12, c2_dy = e1[0] / e12;
+
+        // Create texel points inside the bounding box of the face
+        Vector2d max_corner = box.max(), min_corner = box.min();
+        int top = static_cast<int>(floor(min_corner[1]));  // Note +y is to the bottom
+        int bottom = std::min(static_cast<int>(ceil(max_corner[1])), img_height - 1);
+        int left = static_cast<int>(floor(min_corner[0]));
+        int right = std::min(static_cast<int>(ceil(max_corner[0])), img_width - 1);
+        const int kRowLength = right - left + 1;
+        if (kRowLength <= 0)
+            continue;
+        row_c1.resize(kRowLength);
+        row_c2.resize(kRowLength);
+        row_inside.resize(kRowLength);
+        for (int i = top; i <= bottom; ++i)
+        {
+            double c1_start = (left - v0[0]) * c1_dx + (i - v0[1]) * c1_dy;
+            double c2_start = (left - v0[0]) * c2_dx + (i - v0[1]) * c2_dy;
+            int inside_num = 0;
+            for (int k = 0; k < kRowLength; ++k)
             {
-                int vidx = face.indices[i];
-                if (patch.vertex_to_patch.find(vidx) == patch.vertex_to_patch.end())
+                double c1 = c1_start + k * c1_dx, c2 = c2_start + k * c2_dx;
+                row_c1[k] = c1;
+                row_c2[k] = c2;
+                row_inside[k] = (c1 >= 0) & (c2 >= 0) & (c1 + c2 <= 1);
+                inside_num += row_inside[k];
+            }
+            if (inside_num == 0)
+                continue;
+            for (int k = 0; k < kRowLength; ++k)
+            {
+                if (!row_inside[k])
+                    continue;
+                int j = left + k;
+                int offset = getPatchGridOffset(patch, j, i);
+                if (offset == -1 || patch.texel_grid[offset] != -1)
                 {
-                    PRINT_RED("ERROR: vertex %d is not saved in its patch. This shouldn't happen.", vidx);
+                    // This means the texel point is already created in some other face, since we are using
+                    // bounding box for each face, so there will be overlap between the boxes.
                     continue;
                 }
-                // We already computed uv for each vertex in each cluster before.
-                face.uv[i] = patch.uv_textures[patch.vertex_to_patch[vidx]];
-                face.uv[i][0] *= img_width;
-                face.uv[i][1] = img_height * (1.0 - face.uv[i][1]);
-                box.extend(face.uv[i]);
+                double c1 = row_c1[k], c2 = row_c2[k], c0 = 1 - c1 - c2;
+                // texel's 3D point is computed by interpolation of barycentric coordinates
+                Vector3d pt3_global = c0 * vertices_[face.indices[0]].opt_pt3 + c1 * vertices_[face.indices[1]].opt_pt3 +
+                                      c2 * vertices_[face.indices[2]].opt_pt3;
+                patch.texel_grid[offset] = texels.size();
+                texels.push_back(fidx, Vector2i(j, i), Vector3d(c0, c1, c2), pt3_global);
+            }
+        }
+    }
+}
+
+//! Offset of pixel (x, y) of a texture image in 'texel_grid' of a patch, -1 if the pixel is out of the grid.
+//! The grid covers the patch rectangle with 1 more pixel on each side, since texels on the right and bottom
+//! border of the patch can be 1 pixel out of the rectangle.
+int RGBDMeshOpt::getPatchGridOffset(const TexturePatch& patch, int x, int y)
+{
+    int top = texture_images_[patch.texture_img_idx].rows - patch.bly - patch.height;
+    int gx = x - patch.blx + 1, gy = y - top + 1;
+    if (gx < 0 || gx >= patch.width + 2 || gy < 0 || gy >= patch.height + 2)
+        return -1;
+    return gy * (patch.width + 2) + gx;
+}
+
+void RGBDMeshOpt::computeAllTexelColors()
+{
+    updateTexelVisibilityCache();
+    for (int t = 0; t < texels_.size(); ++t)
+    {
+        if (isTexelInPyramidLevel(t))
+            computeTexelColor(t);
+    }
+}
+
+//! Update candidate frames of texels, which is required before using the cache when texels, poses or planes change.
+/*!
+    For each texel, the cache keeps frames of its face that pass the visibility test ('isCameraPointVisibleInFrame()'),
+    so the depth test is skipped in later loops. When a frame pose or a plane moves more than a threshold since the
+    cache is built, frames rejected before may become visible, so texels related to them are tested again. Texels
+    whose frames and plane don't move keep their cached frames.
+*/
+void RGBDMeshOpt::updateTexelVisibilityCache()
+{
+    const int kTexelNum = texels_.size();
+    bool flag_rebuild_all = int(texel_frame_offsets_.size()) != kTexelNum + 1 ||
+                            int(cached_frame_poses_.size()) != frame_num_ || int(cached_planes_.size()) != cluster_num_;
+    if (flag_rebuild_all)
+    {
+        cached_frame_poses_.resize(frame_num_);
+        cached_planes_.resize(cluster_num_);
+    }
+    else if (!FLAGS_use_visibility_cache)
+        return;  // all visible frames are saved in cache, which are always valid
+    // Find moved frames and planes
+    const double kCosMaxAngle = cos(FLAGS_visibility_cache_rotation_angle);
+    vector<bool> is_frame_moved(frame_num_, flag_rebuild_all), is_plane_moved(cluster_num_, flag_rebuild_all);
+    bool flag_any_moved = flag_rebuild_all;
+    for (int fidx = 0; fidx < frame_num_; ++fidx)
+    {
+        const Matrix4d& T1 = cached_frame_poses_[fidx];
+        const Matrix4d& T2 = frames_[fidx].opt_inv_T;
+        if (!is_frame_moved[fidx])
+        {
+            // cos of relative rotation angle is (trace(R1^T * R2) - 1) / 2
+            double cos_angle = ((T1.block<3, 3>(0, 0).transpose() * T2.block<3, 3>(0, 0)).trace() - 1) / 2;
+            double translation = (T1.block<3, 1>(0, 3) - T2.block<3, 1>(0, 3)).norm();
+            is_frame_moved[fidx] = cos_angle < kCosMaxAngle || translation > FLAGS_visibility_cache_translation;
+        }
+        if (is_frame_moved[fidx])
+        {
+            cached_frame_poses_[fidx] = T2;
+            flag_any_moved = true;
+        }
+    }
+    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+    {
+        const Vector4d& plane = cached_planes_[cidx];
+        if (!is_plane_moved[cidx])
+        {
+            double cos_angle = plane.head<3>().dot(clusters_[cidx].opt_normal);
+            double translation = fabs(plane[3] - clusters_[cidx].opt_w);
+            is_plane_moved[cidx] = cos_angle < kCosMaxAngle || translation > FLAGS_visibility_cache_translation;
+        }
+        if (is_plane_moved[cidx])
+        {
+            const Vector3d& kNormal = clusters_[cidx].opt_normal;
+            cached_planes_[cidx] = Vector4d(kNormal[0], kNormal[1], kNormal[2], clusters_[cidx].opt_w);
+            flag_any_moved = true;
+        }
+    }
+    if (!flag_any_moved)
+        return;
+    const int kViewNum = std::max(0, FLAGS_texel_view_number);
+    if (kViewNum > 0 && int(texel_view_selected_.size()) != kTexelNum)
+    {
+        texel_views_.assign(kTexelNum * kViewNum, -1);
+        texel_view_weights_.assign(kTexelNum * kViewNum, 0);
+        texel_view_selected_.assign(kTexelNum, 0);
+    }
+
+    // Rebuild cache in blocks of texels in parallel, then concatenate them in order
+    const int kBlockTexelNum = 4096;
+    const int kBlockNum = (kTexelNum + kBlockTexelNum - 1) / kBlockTexelNum;
+    vector<vector<int>> block_counts(kBlockNum), block_frames(kBlockNum);
+    vector<vector<Vector2d>> block_pixels(kBlockNum);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < kBlockNum; ++b)
+    {
+        for (int t = b * kBlockTexelNum; t < std::min(kTexelNum, (b + 1) * kBlockTexelNum); ++t)
+        {
+            int fa = texels_.face_id[t];
+            int cidx = faces_[fa].cluster_id;
+            bool flag_rebuild = is_plane_moved[cidx];
+            for (int fidx : faces_[fa].visible_frames)
+                flag_rebuild = flag_rebuild || is_frame_moved[fidx];
+            if (!flag_rebuild)
+            {
+                // Keep cached frames
+                int begin = texel_frame_offsets_[t], end = texel_frame_offsets_[t + 1];
+                block_counts[b].push_back(end - begin);
+                block_frames[b].insert(block_frames[b].end(), texel_frames_.begin() + begin, texel_frames_.begin() + end);
+                block_pixels[b].insert(
+                    block_pixels[b].end(), texel_frame_pixels_.begin() + begin, texel_frame_pixels_.begin() + end);
+                continue;
             }
-            // Create texel points inside the bounding box of the face
-            Vector2d max_corner = box.max(), min_corner = box.min();
-            int top = static_cast<int>(floor(min_corner[1]));  // Note +y is to the bottom
-            int bottom = static_cast<int>(ceil(max_corner[1]));
-            bottom = std::min(bottom, img_height - 1);
-            int left = static_cast<int>(floor(min_corner[0]));
-            int right = static_cast<int>(ceil(max_corner[0]));
-            right = std::min(right, img_width - 1);
-            for (int i = top; i <= bottom; ++i)
+            if (kViewNum > 0)
+                texel_view_selected_[t] = 0;
+            const Vector3d& kNormal = clusters_[cidx].opt_normal;
+            const Vector3d& pt3_global = texels_.pt3_global[t];
+            Vector3d pt3_proj = pt3_global - (pt3_global.dot(kNormal) + clusters_[cidx].opt_w) * kNormal;
+            int count = 0;
+            for (int fidx : faces_[fa].visible_frames)
             {
-                for (int j = left; j <= right; ++j)
+                Vector2d pt2_color(0, 0);
+                if (FLAGS_use_visibility_cache)
                 {
-                    Texel& texel = texels_[tidx][i][j];
-                    if (texel.is_valid)
-                    {
-                        // This means the texel point is already created in some other face, since we are using
-                        // bounding box for each face, so there will be overlap between the boxes.
-                        continue;
-                    }
-                    Vector2d u(j, i);
-                    if (!computeBarycentricCoordinates(u, face.uv[0], face.uv[1], face.uv[2], c0, c1, c2))
+                    Vector3d pt3_local = globalToCameraSpace(pt3_proj, frames_[fidx].opt_inv_T);
+                    if (!isCameraPointVisibleInFrame(pt3_local, fidx, pt2_color))
                         continue;
-                    texel.is_valid = true;
-                    texel.face_id = fidx;
-                    // texel's 3D point is computed by interpolation of barycentric coordinates
-                    texel.pt3_global = c0 * vertices_[face.indices[0]].opt_pt3 + c1 * vertices_[face.indices[1]].opt_pt3 +
-                                       c2 * vertices_[face.indices[2]].opt_pt3;
-                    texel.barycentrics[0] = c0;
-                    texel.barycentrics[1] = c1;
-                    texel.barycentrics[2] = c2;
-                    patch.texel_positions.push_back(make_pair(j, i));
-                    texel_num++;
                 }
+                block_frames[b].push_back(fidx);
+                block_pixels[b].push_back(pt2_color);
+                count++;
             }
+            block_counts[b].push_back(count);
+        }
+    }
+    texel_frame_offsets_.resize(kTexelNum + 1);
+    texel_frame_offsets_[0] = 0;
+    texel_frames_.clear();
+    texel_frame_pixels_.clear();
+    for (int b = 0; b < kBlockNum; ++b)
+    {
+        for (size_t i = 0; i < block_counts[b].size(); ++i)
+        {
+            int t = b * kBlockTexelNum + int(i);
+            texel_frame_offsets_[t + 1] = texel_frame_offsets_[t] + block_counts[b][i];
         }
+        texel_frames_.insert(texel_frames_.end(), block_frames[b].begin(), block_frames[b].end());
+        texel_frame_pixels_.insert(texel_frame_pixels_.end(), block_pixels[b].begin(), block_pixels[b].end());
     }
-    cout << "#Texels: " << texel_num << endl;
 }
 
-void RGBDMeshOpt::computeAllTexelColors()
+//! Clear the cache so that it's fully rebuilt in next update, such as after texels are changed.
+void RGBDMeshOpt::invalidateTexelVisibilityCache()
 {
-    for (TexturePatch& patch : patches_)
+    texel_frame_offsets_.clear();
+    texel_frames_.clear();
+    texel_frame_pixels_.clear();
+    texel_views_.clear();
+    texel_view_weights_.clear();
+    texel_view_selected_.clear();
+}
+
+//! Project a 3D point of a texel into its candidate frame 'texel_frames_[cache_idx]'. Return false if it's not visible.
+//! The depth test is skipped unless the projection moves more than 'visibility_cache_pixel_shift' from the pixel
+//! of last depth test. Cache of the texel should be updated by 'updateTexelVisibilityCache()' before.
+bool RGBDMeshOpt::projectTexelToCachedFrame(const Vector3d& pt3, int cache_idx, Vector3d& pt3_local, Vector2d& pt2_color)
+{
+    int fidx = texel_frames_[cache_idx];
+    pt3_local = globalToCameraSpace(pt3, frames_[fidx].opt_inv_T);
+    if (FLAGS_use_visibility_cache)
     {
-        int tidx = patch.texture_img_idx;
-        for (auto it : patch.texel_positions)
-        {
-            int x = it.first, y = it.second;
-            Texel& texel = texels_[tidx][y][x];
-            computeTexelColorByAverage(texel);
-        }
+        if (!projectCameraPointToFrame(pt3_local, color_calib_, pt2_color))
+            return false;
+        const double kMaxShift = FLAGS_visibility_cache_pixel_shift;
+        if ((pt2_color - texel_frame_pixels_[cache_idx]).squaredNorm() <= kMaxShift * kMaxShift)
+            return true;
     }
+    if (!isCameraPointVisibleInFrame(pt3_local, fidx, pt2_color))
+        return false;
+    texel_frame_pixels_[cache_idx] = pt2_color;
+    return true;
+}
+
+//! Compute the grayscale color of a texel from its visible frames. If 'samples' is given, its projections in the
+//! frames are also appended for computing RGB color by 'computeTexelRGBColorsByFrame()'.
+void RGBDMeshOpt::computeTexelColor(int texel_idx, vector<TexelFrameSample>* samples)
+{
+    if (FLAGS_texel_view_number > 0)
+        computeTexelColorByBestViews(texel_idx, samples);
+    else
+        computeTexelColorByAverage(texel_idx, samples);
 }
 
-void RGBDMeshOpt::computeTexelColorByAverage(Texel& texel)
+//! Average over all visible frames of a texel.
+void RGBDMeshOpt::computeTexelColorByAverage(int texel_idx, vector<TexelFrameSample>* samples)
 {
     int count = 0;
-    int fa = texel.face_id;
+    int fa = texels_.face_id[texel_idx];
     int cidx = faces_[fa].cluster_id;
     const Vector3d& kNormal = clusters_[cidx].opt_normal;
     const double& kW = clusters_[cidx].opt_w;
-    texel.pt3_proj = texel.pt3_global - (texel.pt3_global.dot(kNormal) + kW) * kNormal;
+    const Vector3d& pt3_global = texels_.pt3_global[texel_idx];
+    Vector3d& pt3_proj = texels_.pt3_proj[texel_idx];
+    pt3_proj = pt3_global - (pt3_global.dot(kNormal) + kW) * kNormal;
     double graycolor = 0;
-    Vector3f rgb(0, 0, 0);
-    for (int fidx : faces_[fa].visible_frames)
+    for (int k = texel_frame_offsets_[texel_idx]; k < texel_frame_offsets_[texel_idx + 1]; ++k)
     {
-        Vector3d pt3 = globalToCameraSpace(texel.pt3_proj, frames_[fidx].opt_inv_T);
+        int fidx = texel_frames_[k];
+        Vector3d pt3;
         Vector2d pt2_color;
-        if (!isCameraPointVisibleInFrame(pt3, fidx, pt2_color))
+        if (!projectTexelToCachedFrame(pt3_proj, k, pt3, pt2_color))
             continue;
         graycolor += compute2DPointGraycolorBilinear(pt2_color, fidx);
-        rgb += compute2DPointRGBcolorBilinear(pt2_color, fidx);
+        if (samples)
+            samples->push_back({texel_idx, fidx, pt2_color, 1.0f});
         count++;
     }
     if (count)
+        texels_.opt_graycolor[texel_idx] = graycolor / count;
+}
+
+//! Weighted average over the best views of a texel, selected by 'selectTexelBestViews()'.
+void RGBDMeshOpt::computeTexelColorByBestViews(int texel_idx, vector<TexelFrameSample>* samples)
+{
+    int cidx = faces_[texels_.face_id[texel_idx]].cluster_id;
+    const Vector3d& kNormal = clusters_[cidx].opt_normal;
+    const Vector3d& pt3_global = texels_.pt3_global[texel_idx];
+    Vector3d& pt3_proj = texels_.pt3_proj[texel_idx];
+    pt3_proj = pt3_global - (pt3_global.dot(kNormal) + clusters_[cidx].opt_w) * kNormal;
+    if (!texel_view_selected_[texel_idx])
+        selectTexelBestViews(texel_idx);
+    const int kViewNum = FLAGS_texel_view_number;
+    const int kCacheBegin = texel_frame_offsets_[texel_idx];
+    double graycolor = 0, weight_sum = 0;
+    for (int i = texel_idx * kViewNum; i < (texel_idx + 1) * kViewNum && texel_views_[i] != -1; ++i)
     {
-        graycolor /= count;
-        rgb /= count;
-        texel.opt_graycolor = graycolor;
-        texel.opt_rgb = rgb;
+        int k = kCacheBegin + texel_views_[i];
+        Vector3d pt3;
+        Vector2d pt2_color;
+        if (!projectTexelToCachedFrame(pt3_proj, k, pt3, pt2_color))
+            continue;
+        float weight = texel_view_weights_[i];
+        graycolor += weight * compute2DPointGraycolorBilinear(pt2_color, texel_frames_[k]);
+        weight_sum += weight;
+        if (samples)
+            samples->push_back({texel_idx, texel_frames_[k], pt2_color, weight});
     }
+    if (weight_sum > 0)
+        texels_.opt_graycolor[texel_idx] = graycolor / weight_sum;
 }
 
-//!
-void RGBDMeshOpt::generateFinalTexelColors()
+//! Select the best 'texel_view_number' frames of a texel from its cached frames. A frame scores higher if it is
+//! sharper, views the plane of the texel more frontally and is closer to it, and the score is its blending weight.
+//! The best frame is also saved as 'opt_fidx' of the texel.
+void RGBDMeshOpt::selectTexelBestViews(int texel_idx)
 {
-    for (int cidx = 0; cidx < cluster_num_; ++cidx)
+    const int kViewNum = FLAGS_texel_view_number;
+    int* views = &texel_views_[texel_idx * kViewNum];
+    float* weights = &texel_view_weights_[texel_idx * kViewNum];
+    std::fill(views, views + kViewNum, -1);
+    std::fill(weights, weights + kViewNum, 0.0f);
+    const Vector3d& kNormal = clusters_[faces_[texels_.face_id[texel_idx]].cluster_id].opt_normal;
+    const int kCacheBegin = texel_frame_offsets_[texel_idx];
+    int view_num = 0;
+    for (int k = kCacheBegin; k < texel_frame_offsets_[texel_idx + 1]; ++k)
     {
-        TexturePatch& patch = patches_[cidx];
+        int fidx = texel_frames_[k];
+        Vector3d pt3_local;
+        Vector2d pt2_color;
+        if (!projectTexelToCachedFrame(texels_.pt3_proj[texel_idx], k, pt3_local, pt2_color))
+            continue;
+        double distance = pt3_local.norm();
+        double cos_angle = fabs((frames_[fidx].opt_inv_R * kNormal).dot(pt3_local)) / distance;
+        float score = float(std::max(1 - frames_[fidx].blurriness, 1e-3) * cos_angle / (distance * distance));
+        // Insert into the views sorted by descending score
+        int pos = std::min(view_num, kViewNum - 1);
+        if (view_num == kViewNum && score <= weights[pos])
+            continue;
+        while (pos > 0 && weights[pos - 1] < score)
+        {
+            views[pos] = views[pos - 1];
+            weights[pos] = weights[pos - 1];
+            pos--;
+        }
+        views[pos] = k - kCacheBegin;
+        weights[pos] = score;
+        view_num = std::min(view_num + 1, kViewNum);
+    }
+    texels_.opt_fidx[texel_idx] = (views[0] == -1) ? -1 : texel_frames_[kCacheBegin + views[0]];
+    texel_view_selected_[texel_idx] = 1;
+}
+
+//! Compute RGB colors of texels by weighted averaging of their 'samples' in visible frames. Samples are sorted and processed
+//! frame by frame, so each color image is got only once from the frame cache.
+void RGBDMeshOpt::computeTexelRGBColorsByFrame(vector<TexelFrameSample>& samples)
+{
+    std::stable_sort(samples.begin(), samples.end(),
+        [](const TexelFrameSample& a, const TexelFrameSample& b) { return a.frame_idx < b.frame_idx; });
+    unordered_map<int, pair<Vector3f, float>> rgb_sums;  // texel index -> (weighted sum of RGB colors, weight sum)
+    const int kSampleNum = int(samples.size());
+    vector<Vector2d> pts(kSampleNum);
+    vector<Vector3f> rgbs(kSampleNum);
+    for (int i = 0; i < kSampleNum; ++i)
+        pts[i] = samples[i].pt2_color;
+    for (int begin = 0, end = 0; begin < kSampleNum; begin = end)
+    {
+        while (end < kSampleNum && samples[end].frame_idx == samples[begin].frame_idx)
+            end++;
+        cv::Mat color_img = getFrameColorImage(samples[begin].frame_idx);
+        if (color_img.empty())
+            continue;
+        sampleRGBcolors(color_img, end - begin, &pts[begin], &rgbs[begin]);
+        for (int i = begin; i < end; ++i)
+        {
+            auto it = rgb_sums.find(samples[i].texel_idx);
+            if (it == rgb_sums.end())
+                it = rgb_sums.insert(make_pair(samples[i].texel_idx, make_pair(Vector3f(0, 0, 0), 0.0f))).first;
+            it->second.first += samples[i].weight * rgbs[i];
+            it->second.second += samples[i].weight;
+        }
+    }
+    for (const auto& it : rgb_sums)
+        texels_.opt_rgb[it.first] = it.second.first / it.second.second;
+}
+
+//! Order of patches so that neighboring patches in the order are likely seen by the same frames,
+//! which is by average index of frames seeing the faces of each patch.
+vector<int> RGBDMeshOpt::getPatchOrderForFrameLocality()
+{
+    const int kPatchNum = int(patches_.size());
+    vector<double> mean_frame_idx(kPatchNum, 0);
+    for (int pidx = 0; pidx < kPatchNum; ++pidx)
+    {
+        long long sum = 0, count = 0;
+        for (int fa : clusters_[patches_[pidx].cluster_id].faces)
+        {
+            for (int fidx : faces_[fa].visible_frames)
+                sum += fidx;
+            count += faces_[fa].visible_frames.size();
+        }
+        mean_frame_idx[pidx] = count ? double(sum) / count : 0;
+    }
+    vector<int> order(kPatchNum);
+    for (int pidx = 0; pidx < kPatchNum; ++pidx)
+        order[pidx] = pidx;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return mean_frame_idx[a] < mean_frame_idx[b]; });
+    return order;
+}
 
-        // Expanding patch to neighbor pixels to remove seams between texture patches in final texture mappping
-        expandTexturePatch(patch);
-        int tidx = patch.texture_img_idx;
-        cv::Mat& tex_img = texture_images_[tidx];
-        for (auto it : patch.texel_positions)
+//! Patches are disjoint, so they are expanded and their colors are computed in parallel. Texture images are written
+//! in the same order as the serial version, since texels on the border of adjacent patches can share one pixel.
+void RGBDMeshOpt::generateFinalTexelColors()
+{
+    // Expanding patch to neighbor pixels to remove seams between texture patches in final texture mappping
+    const int kPatchNum = int(patches_.size());
+    vector<TexelTable> new_texels(kPatchNum);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int pidx = 0; pidx < kPatchNum; ++pidx)
+        expandTexturePatch(patches_[pidx], new_texels[pidx]);
+    mergeExpandedTexels(new_texels);
+    updateTexelVisibilityCache();
+
+    // Neighboring patches in this order share frames, so threads working on them reuse cached color images
+    vector<int> patch_order = getPatchOrderForFrameLocality();
+#pragma omp parallel
+    {
+        vector<TexelFrameSample> samples;
+#pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < kPatchNum; ++i)
         {
-            int x = it.first, y = it.second;
-            Texel& texel = texels_[tidx][y][x];
-            computeTexelColorByAverage(texel);
+            const TexturePatch& patch = patches_[patch_order[i]];
+            samples.clear();
+            for (int t = patch.texel_begin; t < patch.texel_end; ++t)
+                computeTexelColor(t, &samples);
+            computeTexelRGBColorsByFrame(samples);
+        }
+    }
+    for (int pidx : patch_order)
+    {
+        const TexturePatch& patch = patches_[pidx];
+        cv::Mat& tex_img = texture_images_[patch.texture_img_idx];
+        for (int t = patch.texel_begin; t < patch.texel_end; ++t)
+        {
+            int x = texels_.position[t][0], y = texels_.position[t][1];
             for (int k = 0; k < 3; ++k)
-                tex_img.at<cv::Vec3b>(y, x)[k] = (unsigned char)(texel.opt_rgb[2 - k] * 255);
+                tex_img.at<cv::Vec3b>(y, x)[k] = (unsigned char)(texels_.opt_rgb[t][2 - k] * 255);
         }
     }
 }
 
-//! Expand each patch from border pixels to their neighbor pixels and add new pixels into the patch.
+//! Expand each patch from border pixels to their neighbor pixels and add new pixels into 'new_texels'.
 //! This is to remove the seams between patches in the final texture images.
-void RGBDMeshOpt::expandTexturePatch(TexturePatch& patch)
+/*!
+    Empty pixels in the patch rectangle within an L1 distance of 10 pixels from the texels are added, which are the
+    pixels reached by expanding the texels ring by ring. Instead of expanding rings one by one, the distance and the
+    nearest texel of each pixel are got by one distance transform over the patch grid, and each new texel uses the
+    face of its nearest texel.
+*/
+void RGBDMeshOpt::expandTexturePatch(TexturePatch& patch, TexelTable& new_texels)
 {
     int tidx = patch.texture_img_idx;
     int img_height = texture_images_[tidx].rows;
@@ -1733,54 +3223,115 @@ void RGBDMeshOpt::expandTexturePatch(TexturePatch& patch)
     int bottom = img_height - patch.bly - 1;
     int left = patch.blx;
     int right = patch.blx + patch.width - 1;
-    int loop = 10;  // number of neighbor pixels to extend. 10 seems good enough.
+    const float kMaxDistance = 10;  // number of neighbor pixels to extend. 10 seems good enough.
     double c0 = 0, c1 = 0, c2 = 0;
-    while (loop-- > 0)
+
+    // Zero pixels of the mask are texels with faces. Their labels are in scan order in the distance transform.
+    const int kGridWidth = patch.width + 2, kGridHeight = patch.height + 2;
+    cv::Mat mask(kGridHeight, kGridWidth, CV_8UC1, cv::Scalar(255));
+    vector<int> label_faces(1, -1);  // label starts from 1
+    for (int offset = 0; offset < kGridWidth * kGridHeight; ++offset)
+    {
+        int t = patch.texel_grid[offset];
+        if (t != -1 && texels_.face_id[t] != -1)
+            mask.data[offset] = 0;
+    }
+    for (int offset = 0; offset < kGridWidth * kGridHeight; ++offset)
+    {
+        if (mask.data[offset] == 0)
+            label_faces.push_back(texels_.face_id[patch.texel_grid[offset]]);
+    }
+    if (label_faces.size() == 1)
+        return;
+    cv::Mat distances, labels;
+    cv::distanceTransform(mask, distances, labels, CV_DIST_L1, CV_DIST_MASK_3, CV_DIST_LABEL_PIXEL);
+    const float* distance_data = distances.ptr<float>();  // same layout as the patch grid
+    const int* label_data = labels.ptr<int>();
+
+    for (int y = top; y <= bottom; ++y)
     {
-        int n = int(patch.texel_positions.size());
-        for (int idx = 0; idx < n; ++idx)
+        for (int x = left; x <= right; ++x)
         {
-            int i = patch.texel_positions[idx].first, j = patch.texel_positions[idx].second;
-            Texel& texel = texels_[tidx][j][i];
-            if (!texel.is_valid)
+            int offset = getPatchGridOffset(patch, x, y);
+            if (patch.texel_grid[offset] != -1 || distance_data[offset] > kMaxDistance)
                 continue;
-            int fidx = texel.face_id;
-            if (fidx == -1)
+            int fidx = label_faces[label_data[offset]];
+            Vector2d u(x, y);
+            computeBarycentricCoordinates(u, faces_[fidx].uv[0], faces_[fidx].uv[1], faces_[fidx].uv[2], c0, c1, c2);
+            if (fabs(c0 + c1 + c2 - 1) > 1e-5)  // ensure barycentric coordinates are valid
                 continue;
-            for (int k = 0; k < 4; ++k)
-            {
-                // Find only patch neighbor texels and expand to its 4 neighbors
-                int x = i + kPixel4NeighDirs[k][0], y = j + kPixel4NeighDirs[k][1];
-                if (x < left || x > right || y < top || y > bottom)
-                    continue;
-                Texel& ntexel = texels_[tidx][y][x];
-                if (ntexel.is_valid)
-                    continue;
-
-                Vector2d u(x, y);
-                computeBarycentricCoordinates(u, faces_[fidx].uv[0], faces_[fidx].uv[1], faces_[fidx].uv[2], c0, c1, c2);
-                if (fabs(c0 + c1 + c2 - 1) > 1e-5)  // ensure barycentric coordinates are valid
-                    continue;
-                ntexel.is_valid = true;
-                ntexel.face_id = fidx;
-                ntexel.pt3_global = c0 * vertices_[faces_[fidx].indices[0]].opt_pt3 +
-                                    c1 * vertices_[faces_[fidx].indices[1]].opt_pt3 +
-                                    c2 * vertices_[faces_[fidx].indices[2]].opt_pt3;
-                int cidx = faces_[fidx].cluster_id;
-                ntexel.pt3_proj =
-                    ntexel.pt3_global -
-                    (ntexel.pt3_global.dot(clusters_[cidx].opt_normal) + clusters_[cidx].opt_w) * clusters_[cidx].opt_normal;
-                patch.texel_positions.push_back(make_pair(x, y));
-            }
+            Vector3d pt3_global = c0 * vertices_[faces_[fidx].indices[0]].opt_pt3 +
+                                  c1 * vertices_[faces_[fidx].indices[1]].opt_pt3 +
+                                  c2 * vertices_[faces_[fidx].indices[2]].opt_pt3;
+            patch.texel_grid[offset] = patch.texel_end + new_texels.size();  // updated in mergeExpandedTexels()
+            new_texels.push_back(fidx, Vector2i(x, y), Vector3d(c0, c1, c2), pt3_global);
+            const Cluster& cluster = clusters_[faces_[fidx].cluster_id];
+            double dis_pt2plane = pt3_global.dot(cluster.opt_normal) + cluster.opt_w;
+            new_texels.pt3_proj.back() = pt3_global - dis_pt2plane * cluster.opt_normal;
         }
     }
 }
 
+//! Append new texels of each patch after its original texels, so texels of each patch are still contiguous.
+void RGBDMeshOpt::mergeExpandedTexels(const vector<TexelTable>& new_texels)
+{
+    TexelTable merged;
+    for (size_t pidx = 0; pidx < patches_.size(); ++pidx)
+    {
+        TexturePatch& patch = patches_[pidx];
+        int begin = merged.size();
+        merged.append(texels_, patch.texel_begin, patch.texel_end);
+        merged.append(new_texels[pidx], 0, new_texels[pidx].size());
+        patch.texel_begin = begin;
+        patch.texel_end = merged.size();
+        for (int t = patch.texel_begin; t < patch.texel_end; ++t)
+            patch.texel_grid[getPatchGridOffset(patch, merged.position[t][0], merged.position[t][1])] = t;
+    }
+    texels_ = std::move(merged);
+    invalidateTexelVisibilityCache();
+}
+
 /************************************************************************/
 /* Math
  */
 /************************************************************************/
 
+//! Loss of a color residual 'r' in plane and pose opt, which equals r^2 for small residuals.
+/*!
+    With scale k: Huber loss is r^2 if |r| <= k, otherwise 2k|r| - k^2; Cauchy loss is k^2 * log(1 + r^2 / k^2).
+    Large residuals (e.g. specular highlights and occlusion boundaries) grow slower than r^2, so they have less
+    influence on the solution.
+*/
+double RGBDMeshOpt::computeRobustLoss(double r)
+{
+    const double k = FLAGS_robust_loss_scale;
+    switch (robust_loss_)
+    {
+    case kHuberLoss:
+        return (fabs(r) <= k) ? r * r : 2 * k * fabs(r) - k * k;
+    case kCauchyLoss:
+        return k * k * log1p(r * r / (k * k));
+    default:
+        return r * r;
+    }
+}
+
+//! Weight of a color residual 'r' in the Gauss-Newton normal equations (iteratively reweighted least squares),
+//! so that a step minimizes the robust loss instead of the squared loss: weight = loss'(r) / (2r).
+double RGBDMeshOpt::computeRobustWeight(double r)
+{
+    const double k = FLAGS_robust_loss_scale;
+    switch (robust_loss_)
+    {
+    case kHuberLoss:
+        return (fabs(r) <= k) ? 1.0 : k / fabs(r);
+    case kCauchyLoss:
+        return 1.0 / (1 + r * r / (k * k));
+    default:
+        return 1.0;
+    }
+}
+
 //! Check if two poses are close to each other.
 bool RGBDMeshOpt::isTwoPosesClose(const Matrix4d& T1, const Matrix4d& T2)
 {
@@ -1794,55 +3345,97 @@ bool RGBDMeshOpt::isTwoPosesClose(const Matrix4d& T1, const Matrix4d& T2)
     return false;
 }
 
-//! Compute the grayscale color gradient of a 2D pixel with a given kernel.
-//! Note: You must ensure that the input pixel 'pt2' is NOT on the image border before calling this function.
-double RGBDMeshOpt::computePixelGraycolorGradient(const Vector2i& pt2, int frame_idx, const double kernel[3][3])
+//! Compute the grayscale color of a 2D point using bilinear interpolation
+double RGBDMeshOpt::compute2DPointGraycolorBilinear(const Vector2d& pt2, int frame_idx)
 {
-    double grad = 0;
-    for (int i = 0; i < 3; ++i)
-        for (int j = 0; j < 3; ++j)
-            grad += static_cast<double>(frames_[frame_idx].gray_img.at<uchar>(pt2[1] - 1 + i, pt2[0] - 1 + j)) * kernel[i][j];
-    return grad / 255;
+    double gray = 0;
+    sampleGraycolorsAndGradients(frame_idx, 1, &pt2, &gray, nullptr);
+    return gray;
 }
 
-//! Compute the gradient of a 2D point using bilinear interpolation (with given image grayscale gradients)
-//! Note: You must ensure that the input pixel is NOT on the image border before calling this function.
-Vector2d RGBDMeshOpt::compute2DPointGraycolorGradientBilinear(const Vector2d& pt2, int frame_idx)
+//! Sample grayscale colors (and gradients if 'grads' is not null) of 'num' points in a frame at current pyramid
+//! level by bilinear interpolation. Points are full resolution pixels, which must NOT be on the image border.
+/*!
+    Gray color and gradients of a point share its bilinear weights and pixel offsets, and all points are in one
+    loop over raw plane pointers without per-point image lookups, so a batch of points in the same frame is much
+    cheaper than sampling them one by one. Points at coarse levels are clamped so that their neighbors are inside.
+*/
+void RGBDMeshOpt::sampleGraycolorsAndGradients(int frame_idx, int num, const Vector2d* pts, double* grays, Vector2d* grads)
 {
-    int x = int(pt2[0]), y = int(pt2[1]);
-    Vector2d grady1 = (static_cast<double>(x) + 1 - pt2[0]) * frames_[frame_idx].pixel_gradients[y][x] +
-                      (pt2[0] - x) * frames_[frame_idx].pixel_gradients[y][x + 1];
-    Vector2d grady2 = (static_cast<double>(x) + 1 - pt2[0]) * frames_[frame_idx].pixel_gradients[y + 1][x] +
-                      (pt2[0] - x) * frames_[frame_idx].pixel_gradients[y + 1][x + 1];
-    return (double(y) + 1 - pt2[1]) * grady1 + (pt2[1] - y) * grady2;
+    const cv::Mat& gray_img = frames_[frame_idx].gray_pyramid[pyramid_level_];
+    const cv::Mat& grad_x = frames_[frame_idx].grad_x_pyramid[pyramid_level_];
+    const cv::Mat& grad_y = frames_[frame_idx].grad_y_pyramid[pyramid_level_];
+    const unsigned char* gray_data = gray_img.data;
+    const float *gx_data = grad_x.ptr<float>(), *gy_data = grad_y.ptr<float>();
+    const size_t kGrayStep = gray_img.step, kGradStep = grad_x.step / sizeof(float);
+    const bool kClamp = pyramid_level_ > 0;
+    const double kScale = 1.0 / (1 << pyramid_level_);
+    const double kMaxX = gray_img.cols - 1.001, kMaxY = gray_img.rows - 1.001;
+    for (int i = 0; i < num; ++i)
+    {
+        double px = pts[i][0], py = pts[i][1];
+        if (kClamp)
+        {
+            px = std::min(std::max((px + 0.5) * kScale - 0.5, 0.0), kMaxX);
+            py = std::min(std::max((py + 0.5) * kScale - 0.5, 0.0), kMaxY);
+        }
+        int x = int(px), y = int(py);
+        double wx1 = px - x, wx0 = 1 - wx1, wy1 = py - y, wy0 = 1 - wy1;
+        const unsigned char* g0 = gray_data + y * kGrayStep + x;
+        const unsigned char* g1 = g0 + kGrayStep;
+        grays[i] = (wy0 * (wx0 * g0[0] + wx1 * g0[1]) + wy1 * (wx0 * g1[0] + wx1 * g1[1])) / 255;
+        if (grads)
+        {
+            size_t offset = y * kGradStep + x;
+            const float *gx0 = gx_data + offset, *gx1 = gx0 + kGradStep;
+            const float *gy0 = gy_data + offset, *gy1 = gy0 + kGradStep;
+            // Gradient w.r.t. full resolution pixels
+            grads[i][0] = (wy0 * (wx0 * gx0[0] + wx1 * gx0[1]) + wy1 * (wx0 * gx1[0] + wx1 * gx1[1])) * kScale;
+            grads[i][1] = (wy0 * (wx0 * gy0[0] + wx1 * gy0[1]) + wy1 * (wx0 * gy1[0] + wx1 * gy1[1])) * kScale;
+        }
+    }
 }
 
-//! Compute the grayscale color of a 2D point using bilinear interpolation
-double RGBDMeshOpt::compute2DPointGraycolorBilinear(const Vector2d& pt2, int frame_idx)
+//! Sort projections by frame, then sample gray colors and gradients of each frame in one batch. Results are saved
+//! in 'grays' and 'grads' in the sorted order, and 'pts' is a buffer of projection pixels.
+void RGBDMeshOpt::sampleTexelProjections(
+    vector<TexelProjection>& projections, vector<Vector2d>& pts, vector<double>& grays, vector<Vector2d>& grads)
 {
-    int x = int(pt2[0]), y = int(pt2[1]);
-    double grayy1 = (static_cast<double>(x) + 1 - pt2[0]) * static_cast<double>(frames_[frame_idx].gray_img.at<uchar>(y, x)) +
-                    (pt2[0] - x) * double(frames_[frame_idx].gray_img.at<uchar>(y, x + 1));
-    double grayy2 =
-        (static_cast<double>(x) + 1 - pt2[0]) * static_cast<double>(frames_[frame_idx].gray_img.at<uchar>(y + 1, x)) +
-        (pt2[0] - x) * double(frames_[frame_idx].gray_img.at<uchar>(y + 1, x + 1));
-    return ((static_cast<double>(y) + 1 - pt2[1]) * grayy1 + (pt2[1] - y) * grayy2) / 255;
+    // A texel has at most one projection in each frame, so the order is unique
+    std::sort(projections.begin(), projections.end(), [](const TexelProjection& a, const TexelProjection& b) {
+        return a.frame_idx < b.frame_idx || (a.frame_idx == b.frame_idx && a.texel_idx < b.texel_idx);
+    });
+    const int kNum = int(projections.size());
+    pts.resize(kNum);
+    grays.resize(kNum);
+    grads.resize(kNum);
+    for (int i = 0; i < kNum; ++i)
+        pts[i] = projections[i].pt2_color;
+    for (int begin = 0, end = 0; begin < kNum; begin = end)
+    {
+        while (end < kNum && projections[end].frame_idx == projections[begin].frame_idx)
+            end++;
+        sampleGraycolorsAndGradients(projections[begin].frame_idx, end - begin, &pts[begin], &grays[begin], &grads[begin]);
+    }
 }
 
-Vector3f RGBDMeshOpt::compute2DPointRGBcolorBilinear(const Vector2d& pt2, int frame_idx)
+//! Sample RGB colors (in [0, 1]) of 'num' full resolution points in a color image by bilinear interpolation.
+void RGBDMeshOpt::sampleRGBcolors(const cv::Mat& color_img, int num, const Vector2d* pts, Vector3f* rgbs)
 {
-    Vector3f x0y0, x1y0, x0y1, x1y1;
-    int x = int(pt2[0]), y = int(pt2[1]);
-    for (int i = 0; i < 3; ++i)
+    const unsigned char* data = color_img.data;
+    const size_t kStep = color_img.step;
+    for (int i = 0; i < num; ++i)
     {
-        x0y0[i] = float(frames_[frame_idx].color_img.at<cv::Vec3b>(y, x)[2 - i]);
-        x1y0[i] = float(frames_[frame_idx].color_img.at<cv::Vec3b>(y, x + 1)[2 - i]);
-        x0y1[i] = float(frames_[frame_idx].color_img.at<cv::Vec3b>(y + 1, x)[2 - i]);
-        x1y1[i] = float(frames_[frame_idx].color_img.at<cv::Vec3b>(y + 1, x + 1)[2 - i]);
+        float px = float(pts[i][0]), py = float(pts[i][1]);
+        int x = int(px), y = int(py);
+        float wx1 = px - x, wx0 = 1 - wx1, wy1 = py - y, wy0 = 1 - wy1;
+        const unsigned char* c0 = data + y * kStep + 3 * x;
+        const unsigned char* c1 = c0 + kStep;
+        for (int k = 0; k < 3; ++k)  // BGR to RGB
+        {
+            rgbs[i][k] = (wy0 * (wx0 * c0[2 - k] + wx1 * c0[5 - k]) + wy1 * (wx0 * c1[2 - k] + wx1 * c1[5 - k])) / 255;
+        }
     }
-    Vector3f y0color = (float(x) + 1 - float(pt2[0])) * x0y0 + (float(pt2[0]) - x) * x1y0;
-    Vector3f y1color = (float(x) + 1 - float(pt2[0])) * x0y1 + (float(pt2[0]) - x) * x1y1;
-    return ((float(y) + 1 - float(pt2[1])) * y0color + (float(pt2[1]) - y) * y1color) / 255;
 }
 
 //! Compute a 2D point's barycentric coordinates in triangle (v0, v1, v2). Return true if
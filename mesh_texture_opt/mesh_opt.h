@@ -9,14 +9,22 @@
 #include <unordered_map>
 #include <chrono>
 #include <memory>
+#include <list>
+#include <mutex>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "../common/covariance.h"
+#include "../common/frame_bundle.h"
 #include <gflags/gflags.h>
 
 using namespace std;
 using namespace Eigen;
 
+typedef Matrix<double, 6, 6> Matrix6d;
+typedef Matrix<double, 6, 1> Vector6d;
+typedef Matrix<double, Dynamic, 3, RowMajor> RowMatrixX3d;
+typedef Matrix<double, 6, 4> Matrix64d;
+
 class RGBDMeshOpt
 {
 public:
@@ -100,7 +108,8 @@ private:
         CovObj cov;
         Vector3d normal, center, opt_normal, opt_center, last_normal;
         double w, opt_w, last_w;
-        MatrixXd JTJ, JTr;  // plane Jacobian
+        Matrix4d JTJ;  // plane Jacobian, only the upper triangular part is accumulated
+        Vector4d JTr;
         Cluster() : is_valid(false), is_visible(false), is_optimized(false) {}
     };
 
@@ -110,46 +119,119 @@ private:
         Matrix4d T, inv_T, opt_T, opt_inv_T, lastT;  // camera pose parameters
         Matrix3d R, inv_R, opt_R, opt_inv_R;
         Vector3d t, opt_t, inv_t, opt_inv_t;
-        MatrixXd JTJ, JTr;  // Jacobians
-        cv::Mat color_img, depth_img, gray_img;
+        Matrix6d JTJ;  // Jacobians, only the upper triangular part is accumulated
+        Vector6d JTr;
+        cv::Mat color_img, depth_img, gray_img;  // color image may be evicted, see 'getFrameColorImage()'
+        string color_filename;
+        int source_idx;     // frame index in the RGB-D sequence
+        double blurriness;  // from 'image_blurriness_'
         vector<int> visible_vertices;
-        vector<vector<Vector2d>> pixel_gradients;  // grayscale color gradients, row-major with size color_height x color_width
-        Frame() : is_optimized(false) {}
+        cv::Mat grad_x, grad_y;  // grayscale color gradients (CV_32F) in x and y, same size as the color image
+        // Image pyramids for coarse-to-fine optimization. Level 0 shares data with 'gray_img', 'grad_x' and 'grad_y'.
+        vector<cv::Mat> gray_pyramid, grad_x_pyramid, grad_y_pyramid;
+        Frame() : is_optimized(false), source_idx(-1), blurriness(0) {}
+    };
+
+    // A texture image being packed by the MaxRects algorithm. Free rectangles are all maximal empty rectangles (so
+    // they may overlap), in pixels with the bottom-left corner of the image as origin.
+    struct TextureAtlas
+    {
+        int width, height;
+        vector<cv::Rect> free_rects;
+        int max_free_width, max_free_height;  // max width and height of free rectangles, to skip full atlases quickly
+        int used_width, used_height;          // bounding box of packed patches
     };
 
-    // A binary tree structure for packing patches in texture images
-    struct TreeNode
+    // A texel is a pixel in some texture image, and is created from its corresponding patch. Only texels inside
+    // patches are saved, in a structure-of-arrays table where texels of each patch are in a contiguous range.
+    struct TexelTable
     {
-        bool is_leaf;                   // leaf node flag
-        int minx, miny, width, height;  // bounding box parameters
-        std::unique_ptr<TreeNode> left, right;
-        // An empty node is a non-leaf node (with patch in it)
-        TreeNode() : is_leaf(false), minx(0), miny(0), width(0), height(0), left(nullptr), right(nullptr) {}
-        TreeNode(int x, int y, int w, int h)  // a node with data is a leaf by default
-            : is_leaf(true), minx(x), miny(y), width(w), height(h), left(nullptr), right(nullptr)
+        vector<int> face_id;
+        vector<int> opt_fidx;       // best frame, -1 denotes not visible to any frame
+        vector<Vector2i> position;  // (x, y) in its texture image
+        vector<Vector3d> barycentrics, pt3_global, pt3_proj;
+        vector<double> opt_graycolor;
+        vector<Vector3f> opt_rgb;
+
+        int size() const { return int(face_id.size()); }
+        void clear() { *this = TexelTable(); }
+        void push_back(int fidx, const Vector2i& pos, const Vector3d& bary, const Vector3d& pt3)
+        {
+            face_id.push_back(fidx);
+            opt_fidx.push_back(-1);
+            position.push_back(pos);
+            barycentrics.push_back(bary);
+            pt3_global.push_back(pt3);
+            pt3_proj.push_back(pt3);
+            opt_graycolor.push_back(0);
+            opt_rgb.push_back(Vector3f(1.0, 1.0, 1.0));
+        }
+        // Append texels in range [begin, end) of another table
+        void append(const TexelTable& other, int begin, int end)
         {
+            face_id.insert(face_id.end(), other.face_id.begin() + begin, other.face_id.begin() + end);
+            opt_fidx.insert(opt_fidx.end(), other.opt_fidx.begin() + begin, other.opt_fidx.begin() + end);
+            position.insert(position.end(), other.position.begin() + begin, other.position.begin() + end);
+            barycentrics.insert(barycentrics.end(), other.barycentrics.begin() + begin, other.barycentrics.begin() + end);
+            pt3_global.insert(pt3_global.end(), other.pt3_global.begin() + begin, other.pt3_global.begin() + end);
+            pt3_proj.insert(pt3_proj.end(), other.pt3_proj.begin() + begin, other.pt3_proj.begin() + end);
+            opt_graycolor.insert(opt_graycolor.end(), other.opt_graycolor.begin() + begin, other.opt_graycolor.begin() + end);
+            opt_rgb.insert(opt_rgb.end(), other.opt_rgb.begin() + begin, other.opt_rgb.begin() + end);
         }
     };
 
-    struct ImgPixel
+    // Projection of a texel in one of its visible frames, used to sample colors frame by frame
+    struct TexelFrameSample
     {
-        double graycolor;
+        int texel_idx, frame_idx;
         Vector2d pt2_color;
-        ImgPixel() : graycolor(0) {}
+        float weight;  // blending weight of this frame
     };
 
-    // A texel is a pixel in some texture image, and is created from its corresponding patch.
-    struct Texel
+    // Linear system of geometry optimization for one connected component of the mesh. Only the lower triangular
+    // part of JTJ is saved, and its sparsity pattern and symbolic factorization are reused across runs. Large
+    // components solved by conjugate gradient have no JTJ and solver.
+    struct GeometrySystem
     {
-        bool is_valid;
-        int face_id;
-        int opt_fidx;  // best frame, -1 denotes not visible to any frame
-        double opt_graycolor;
-        Vector3f opt_rgb;
-        Vector3d pt3_global, pt3_proj;
-        Vector3d barycentrics;
-        unordered_map<int, ImgPixel> visible_frame_pixels;  // visible frame -> projection pixel on color image in the frame
-        Texel() : is_valid(false), face_id(-1), opt_fidx(-1), opt_graycolor(0), opt_rgb(1.0, 1.0, 1.0) {}
+        SparseMatrix<double> JTJ;
+        std::unique_ptr<SimplicialLLT<SparseMatrix<double>, Lower>> solver;
+    };
+
+    // Normal equations of joint pose and plane optimization, linearized at the current poses and planes:
+    // [U W; W^T V] [pose deltas; plane deltas] = -[bu; bv]. U and V are block diagonal (per frame and per cluster,
+    // only the upper triangular parts are accumulated), and W has one 6x4 block for each observed (frame, cluster) pair.
+    struct JointSystem
+    {
+        struct Block
+        {
+            int frame_idx, cluster_idx;
+            Matrix64d W;
+        };
+        vector<Matrix6d> U;
+        vector<Vector6d> bu;
+        vector<Matrix4d> V;
+        vector<Vector4d> bv;
+        vector<unsigned char> is_cluster_optimized;
+        vector<Block> blocks;  // sorted by cluster and then frame
+        double energy1, energy2;  // color difference and (unweighted) point-plane distance energies
+    };
+
+    // Sparse reduced pose system of joint opt, only the lower triangular part is saved. Its sparsity pattern (block
+    // row f has non-zero 6x6 blocks at frames 'row_frames[row_offsets[f]]' to 'row_frames[row_offsets[f + 1] - 1]')
+    // and symbolic factorization are kept for the next solve with the same pattern.
+    struct ReducedPoseSystem
+    {
+        vector<int> row_offsets, row_frames;
+        SparseMatrix<double> S;
+        std::unique_ptr<SimplicialLDLT<SparseMatrix<double>, Lower>> solver;
+    };
+
+    // Projection of a texel in one of its cached frames, gathered and sorted by frame for batched sampling
+    struct TexelProjection
+    {
+        int texel_idx, frame_idx;
+        Vector3d pt3_local;
+        Vector2d pt2_color;
     };
 
     // A texture patch is a 2D rectangle region for one cluster/plane. It contains texels and 2D vertices projected from
@@ -164,10 +246,12 @@ private:
         Vector2i texture_img_blpos;               // bottom left position in the final texture image
         unordered_map<int, int> vertex_to_patch;  // mesh vertex index -> new index in patch (start from 0)
         vector<Vector2d> uv_textures;             // texture uv-coords for each vertex, same size as 'vertex_to_patch'
-        vector<pair<int, int>> texel_positions;   // texel positions (i, j) in texture image 'texture_img_idx'
-        vector<VectorXd> jrow;                    // Jacobian row, used in pose optimization
-        vector<double> proj_graycolor;            // grayscale color of each 3D texel projected in 2D, used in pose opt too
-        TexturePatch() : width(0), height(0), area(0), texture_img_idx(-1), cluster_id(-1), base_vtx_index(0) {}
+        int texel_begin, texel_end;               // texels of the patch are in range [begin, end) of 'texels_'
+        vector<int> texel_grid;                   // texel index of each pixel in the patch rectangle, -1 for none
+        TexturePatch()
+            : width(0), height(0), area(0), texture_img_idx(-1), cluster_id(-1), base_vtx_index(0), texel_begin(0), texel_end(0)
+        {
+        }
     };
 
 private:
@@ -185,23 +269,54 @@ private:
     void createTexturePatches();
     void packAllPatches();
     void computeTexelsForAllPatches();
+    void rasterizePatchTexels(TexturePatch& patch, TexelTable& texels);
     void computeAllTexelColors();
-    bool packPatchRecursive(std::unique_ptr<TreeNode>& root, TexturePatch& patch);
-    void computeTexelColorByAverage(Texel& texel);
+    void updateTexelVisibilityCache();
+    void invalidateTexelVisibilityCache();
+    bool projectTexelToCachedFrame(const Vector3d& pt3, int cache_idx, Vector3d& pt3_local, Vector2d& pt2_color);
+    bool findPatchPositionInAtlas(const TextureAtlas& atlas, const TexturePatch& patch, cv::Rect& rect);
+    void placeRectInAtlas(TextureAtlas& atlas, const cv::Rect& rect);
+    void rotateTexturePatch(TexturePatch& patch);
+    int getPatchGridOffset(const TexturePatch& patch, int x, int y);
+    void computeTexelColor(int texel_idx, vector<TexelFrameSample>* samples = nullptr);
+    void computeTexelColorByAverage(int texel_idx, vector<TexelFrameSample>* samples);
+    void computeTexelColorByBestViews(int texel_idx, vector<TexelFrameSample>* samples);
+    void selectTexelBestViews(int texel_idx);
+    void computeTexelRGBColorsByFrame(vector<TexelFrameSample>& samples);
+    vector<int> getPatchOrderForFrameLocality();
+    cv::Mat getFrameColorImage(int frame_idx);
+    void addFrameColorImageToCache(int frame_idx, const cv::Mat& img);
     void generateFinalTexelColors();
-    void expandTexturePatch(TexturePatch& patch);
+    void expandTexturePatch(TexturePatch& patch, TexelTable& new_texels);
+    void mergeExpandedTexels(const vector<TexelTable>& new_texels);
     void runPlaneAndCameraPoseOpt();
+    int getPyramidLevelOfLoop(int loop);
+    void setPyramidLevel(int level);
+    bool isTexelInPyramidLevel(int texel_idx);
     void optimizePoses();
+    Matrix4d expSE3(const Vector6d& Xi);
+    void setFrameOptPose(int frame_idx, const Matrix4d& inv_T);
     void optimizePlanes();
+    void optimizePosesAndPlanes();
+    void buildJointSystem(JointSystem& system);
+    bool solveJointSystem(const JointSystem& system, double damping, vector<Vector6d>& pose_deltas,
+        vector<Vector4d>& plane_deltas, double& predicted_decrease);
     void runMeshGeometryOpt();
+    void initGeometrySystems();
+    void addToSymmetricSparseEntry(SparseMatrix<double>& mat, int row, int col, double val);
+    void fillGeometrySystem(int cidx, const vector<int>& texels, SparseMatrix<double>* JTJ, MatrixXd& JTR);
+    bool solveGeometryByCG(int cidx, const vector<int>& texels, const MatrixXd& JTR);
     void getConnectedComponents();
 
     /* Math */
     bool isTwoPosesClose(const Matrix4d& T1, const Matrix4d& T2);
-    double computePixelGraycolorGradient(const Vector2i& pt2, int frame_idx, const double kernel[3][3]);
-    Vector2d compute2DPointGraycolorGradientBilinear(const Vector2d& pt2, int frame_idx);
+    double computeRobustLoss(double r);
+    double computeRobustWeight(double r);
     double compute2DPointGraycolorBilinear(const Vector2d& pt2, int frame_idx);
-    Vector3f compute2DPointRGBcolorBilinear(const Vector2d& pt2, int frame_idx);
+    void sampleGraycolorsAndGradients(int frame_idx, int num, const Vector2d* pts, double* grays, Vector2d* grads);
+    void sampleTexelProjections(
+        vector<TexelProjection>& projections, vector<Vector2d>& pts, vector<double>& grays, vector<Vector2d>& grads);
+    void sampleRGBcolors(const cv::Mat& color_img, int num, const Vector2d* pts, Vector3f* rgbs);
 
     bool isCameraPointVisibleInFrame(const Vector3d& pt3, int frame_idx, Vector2d& pt2_color);
     bool computeBarycentricCoordinates(
@@ -224,17 +339,6 @@ private:
     Vector3d projectPixelOntoLocalPlane(Vector2i& pt2, CalibrationParams& calib, const Matrix3d& R, const Vector3d& t,
         const Vector3d& plane_normal, const double& plane_w);
 
-    // Use a long long int variable as a key in a map for a pair of ints
-    inline long long getKey(long long a, long long b)
-    {
-        return (a << 32) | b;  // higher digits is a
-    }
-    // Split a long long int into original two integers
-    inline void getPair(long long key, int& v1, int& v2)
-    {
-        v2 = int(key & 0xffffffffLL);  // lower digits is v2
-        v1 = int(key >> 32);           // higher digits is v1
-    }
 
 private:
     /* 3D Mesh */
@@ -250,16 +354,48 @@ private:
     vector<Frame> frames_;
     unordered_map<int, double> image_blurriness_;
     double depth_scale_factor_;
+    FrameBundleReader frame_bundle_;  // only opened with flag 'frame_bundle'
+
+    /* LRU cache of color images, only used when 'frame_cache_mb' > 0 */
+    std::list<int> color_cache_lru_;  // frame indices of cached color images, the most recently used first
+    unordered_map<int, std::list<int>::iterator> color_cache_pos_;
+    size_t color_cache_bytes_;
+    std::mutex color_cache_mutex_;
 
     /* Textures */
     vector<TexturePatch> patches_;          // for all clusters
     vector<cv::Mat> texture_images_;        // final packed texture images
-    vector<vector<vector<Texel>>> texels_;  // texels in all texture image, its 3D since each texture image is 2D
+    TexelTable texels_;                     // texels of all patches
+
+    /* Texel-frame visibility cache */
+    // Candidate frames of texel t (passed the visibility test when cached) are in range
+    // [texel_frame_offsets_[t], texel_frame_offsets_[t + 1]) of 'texel_frames_' and 'texel_frame_pixels_'.
+    vector<int> texel_frame_offsets_, texel_frames_;
+    vector<Vector2d> texel_frame_pixels_;  // projection pixel on color image when last checked by visibility test
+    vector<Matrix4d> cached_frame_poses_;  // frame 'opt_inv_T' when the cache is built
+    vector<Vector4d> cached_planes_;       // cluster (opt_normal, opt_w) when the cache is built
+    // Best views of texel t, only used when 'texel_view_number' > 0: 'texel_view_number' slots from
+    // t * texel_view_number, each is an index in the cached frames of the texel (-1 for empty) and its weight.
+    // They are selected again after cached frames of the texel are updated.
+    vector<int> texel_views_;
+    vector<float> texel_view_weights_;
+    vector<unsigned char> texel_view_selected_;
 
     /* Optimization */
     double last_global_energy_, curr_global_energy_, last_color_energy_;
-    vector<vector<int>> connected_components_;
+    vector<vector<int>> connected_components_;  // without the fixed vertex of each component
+    vector<int> component_fixed_vertices_;
+    vector<GeometrySystem> geometry_systems_;  // for all components
+    ReducedPoseSystem reduced_pose_system_;     // only used by joint opt with many frames
     double lambda1_;
+    int pyramid_level_;  // current level of image pyramids, 0 for full resolution
+    enum RobustLoss
+    {
+        kSquaredLoss,
+        kHuberLoss,
+        kCauchyLoss,
+    };
+    RobustLoss robust_loss_;  // loss of color differences in plane and pose opt, set by flag 'robust_loss'
 
     /* constants */
     const double kPI = 3.1415926;
@@ -267,17 +403,6 @@ private:
     const double kLargestDepth = 6.0;
     const double kDepthResidue = 0.05;
 
-    // Image gradient kernels
-    const double kScharrKernelX[3][3] = {
-        {-3.0 / 16, 0, 3.0 / 16},
-        {-10.0 / 16, 0, 10.0 / 16},
-        {-3.0 / 16, 0, 3.0 / 16},
-    };
-    const double kScharrKernelY[3][3] = {
-        {-3.0 / 16, -10.0 / 16, -3.0 / 16},
-        {0, 0, 0},
-        {3.0 / 16, 10.0 / 16, 3.0 / 16},
-    };
     // pixel neighbors
     const int kPixel8NeighDirs[8][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1}};
     const int kPixel4NeighDirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
@@ -1,6 +1,11 @@
 // Include standard headers
 #include <GL/glew.h>
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
 #include <GLFW/glfw3.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "shader.h"
@@ -8,7 +13,13 @@
 #include <iostream>
 #include "../common/tools.h"
 
+#ifdef USE_EGL
+EGLDisplay egl_display = EGL_NO_DISPLAY;
+EGLContext egl_context = EGL_NO_CONTEXT;
+EGLSurface egl_surface = EGL_NO_SURFACE;
+#else
 GLFWwindow* window;
+#endif
 
 // For apt0-boxes.ply
 // const int kStartFrameIdx = 1150;
@@ -29,6 +40,7 @@ enum ProgramMode
 };
 ProgramMode program_mode_ = RENDER_MODEL;
 
+#ifndef USE_EGL
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
@@ -36,10 +48,13 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     // height will be significantly larger than specified on retina displays.
     glViewport(0, 0, width, height);
 }
+#endif
 
 void printUsage()
 {
-    PRINT_RED("Usage: mesh_visibility -option input_mesh RGBD_path output_path start_frame end_frame");
+    PRINT_RED(
+        "Usage: mesh_visibility -option input_mesh RGBD_path output_path start_frame end_frame [depth_residue "
+        "max_view_angle]");
     cout << "-option:" << endl
          << "  -r: render model only (use left and right arrow to move forward and backward frames)" << endl
          << "  -d: save rendered depth images" << endl
@@ -51,8 +66,123 @@ void printUsage()
     cout << "RGBD_path:" << endl << "   contains camera pose files (filename like 'frame-XXXXXX.pose.txt')" << endl;
     cout << "output_path: " << endl << "   path for output files (filename will be like 'frame-XXXXXX.suffix')" << endl;
     cout << "start_frame, end_frame:" << endl << "   start and end frame index (such as 0, 1000, respectively)" << endl;
+    cout << "depth_residue, max_view_angle (optional, only for -v and -a):" << endl
+         << "   read real depth images 'frame-XXXXXX.depth.png' in RGBD_path, and only save visible vertices whose rendered"
+            " depth differs from the real depth by less than depth_residue (in meter, such as 0.05), and whose viewing"
+            " angle is less than max_view_angle (in degree, 90 by default)"
+         << endl;
+}
+
+//! Initialize GLEW and the OpenGL states shared by all modes. Must be called with a current context.
+bool initGLEW()
+{
+    glewExperimental = true;  // Needed for core profile
+    GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // A GLEW library built for GLX reports this error for an EGL context, but all core functions are loaded anyway.
+    if (err == GLEW_ERROR_NO_GLX_DISPLAY)
+        err = GLEW_OK;
+#endif
+    if (err != GLEW_OK)
+    {
+        fprintf(stderr, "Failed to initialize GLEW\n");
+        return false;
+    }
+
+    // Dark blue background
+    glClearColor(0.0f, 0.0f, 0.4f, 0.0f);
+
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    return true;
+}
+
+#ifdef USE_EGL
+//! Get an EGL display without any window system. A GPU device display (EGL_EXT_platform_device) is preferred
+//! since it needs no X server at all. Fall back to the default display otherwise (e.g. Mesa surfaceless).
+EGLDisplay getHeadlessEGLDisplay()
+{
+    PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglQueryDevicesEXT && eglGetPlatformDisplayEXT)
+    {
+        const int kMaxDevices = 16;
+        EGLDeviceEXT devices[kMaxDevices];
+        EGLint device_num = 0;
+        if (eglQueryDevicesEXT(kMaxDevices, devices, &device_num) && device_num > 0)
+        {
+            EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_DEVICE_EXT, devices[0], NULL);
+            if (display != EGL_NO_DISPLAY)
+                return display;
+        }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
 }
 
+//! Create an offscreen OpenGL context with EGL. All rendering goes to the frame buffer in 'GBuffer', so no
+//! window is needed and a tiny pbuffer surface is only created if surfaceless context is not supported.
+bool initEGL()
+{
+    egl_display = getHeadlessEGLDisplay();
+    EGLint major = 0, minor = 0;
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor))
+    {
+        std::cout << "Failed to initialize EGL display" << std::endl;
+        return false;
+    }
+    const EGLint config_attribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint config_num = 0;
+    if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &config_num) || config_num < 1)
+    {
+        std::cout << "Failed to choose EGL config" << std::endl;
+        eglTerminate(egl_display);
+        return false;
+    }
+    const char* extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+    bool flag_surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context") != NULL;
+    if (!flag_surfaceless)
+    {
+        const EGLint pbuffer_attribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        egl_surface = eglCreatePbufferSurface(egl_display, config, pbuffer_attribs);
+        if (egl_surface == EGL_NO_SURFACE)
+        {
+            std::cout << "Failed to create EGL pbuffer surface" << std::endl;
+            eglTerminate(egl_display);
+            return false;
+        }
+    }
+    eglBindAPI(EGL_OPENGL_API);
+    // Same context version and profile as the GLFW window
+    const EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+    if (egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+    {
+        std::cout << "Failed to create EGL context" << std::endl;
+        eglTerminate(egl_display);
+        return false;
+    }
+    if (!initGLEW())
+    {
+        eglTerminate(egl_display);
+        return false;
+    }
+    return true;
+}
+
+void terminateEGL()
+{
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egl_display, egl_context);
+    if (egl_surface != EGL_NO_SURFACE)
+        eglDestroySurface(egl_display, egl_surface);
+    eglTerminate(egl_display);
+}
+#else
 bool initGLFW()
 {
     if (!glfwInit())
@@ -85,10 +215,8 @@ bool initGLFW()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
     // Initialize GLEW
-    glewExperimental = true;  // Needed for core profile
-    if (glewInit() != GLEW_OK)
+    if (!initGLEW())
     {
-        fprintf(stderr, "Failed to initialize GLEW\n");
         getchar();
         glfwTerminate();
         return false;
@@ -97,15 +225,10 @@ bool initGLFW()
     // Ensure we can capture the escape key being pressed below
     glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
 
-    // Dark blue background
-    glClearColor(0.0f, 0.0f, 0.4f, 0.0f);
-
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
-
     return true;
 }
 
+
 void runRenderMode(MeshVisibility* mesh, int start_fidx, int end_fidx)
 {
     Shader myshader;
@@ -163,8 +286,9 @@ void runRenderMode(MeshVisibility* mesh, int start_fidx, int end_fidx)
     while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS && glfwWindowShouldClose(window) == 0);
     myshader.deleteProgram();
 }
+#endif
 
-void runSaveMode(MeshVisibility* mesh, int start_fidx, int end_fidx, const string& output_path)
+void runSaveMode(MeshVisibility* mesh, int start_fidx, int end_fidx, const string& rgbd_path, const string& output_path)
 {
     Shader myshader;
     myshader.LoadShaders("savemode.vert", "savemode.frag");
@@ -216,6 +340,17 @@ void runSaveMode(MeshVisibility* mesh, int start_fidx, int end_fidx, const strin
             printProgressBar(progress);
         }
         string output_fname = output_path + mesh->getFilename(current_frame);
+        cv::Mat depth_img;  // real depth image, only used to filter visible vertices
+        if (mesh->depth_residue_ > 0 && (program_mode_ == SAVE_VISIBILITY || program_mode_ == SAVE_ALL_FILES))
+        {
+            string depth_fname = rgbd_path + mesh->getFilename(fidx) + ".depth.png";
+            depth_img = cv::imread(depth_fname, cv::IMREAD_ANYDEPTH);
+            if (depth_img.empty() || depth_img.depth() != CV_16U)
+            {
+                PRINT_YELLOW("WARNING: cannot read depth image %s. Skip depth filter in this frame.", depth_fname.c_str());
+                depth_img = cv::Mat();
+            }
+        }
         if (program_mode_ == SAVE_VERTEX_COLOR_IMAGE)
             mesh->saveColor2PNG(output_fname + ".rcolor.png");
         else if (program_mode_ == SAVE_DEPTH_IMAGE)
@@ -223,12 +358,12 @@ void runSaveMode(MeshVisibility* mesh, int start_fidx, int end_fidx, const strin
         else if (program_mode_ == SAVE_TEXTURE_IMAGE)
             mesh->saveColor2PNG(output_fname + ".rtexture.png");
         else if (program_mode_ == SAVE_VISIBILITY)
-            mesh->saveVisibleVertices2Binary(output_fname + ".visibility.txt");
+            mesh->saveVisibleVertices2Binary(output_fname + ".visibility.txt", current_frame, depth_img);
         else if (program_mode_ == SAVE_ALL_FILES)
         {
             mesh->saveColor2PNG(output_fname + ".rcolor.png");
             mesh->saveDepth2PNG(output_fname + ".rdepth.png");
-            mesh->saveVisibleVertices2Binary(output_fname + ".visibility.txt");
+            mesh->saveVisibleVertices2Binary(output_fname + ".visibility.txt", current_frame, depth_img);
             // This is to save the entire visibility image into binary.
             // mesh->saveVisibilityImage2Binary(output_fname + ".visimage.txt");
         }
@@ -242,7 +377,7 @@ void runSaveMode(MeshVisibility* mesh, int start_fidx, int end_fidx, const strin
 
 int main(int argc, char** argv)
 {
-    if (argc != 7)
+    if (argc < 7 || argc > 9)
     {
         printUsage();
         return -1;
@@ -271,6 +406,8 @@ int main(int argc, char** argv)
     if (output_path.back() != '/' && output_path.back() != '\\')
         output_path += "/";
     const int kStartFrameIdx = atoi(argv[5]), kEndFrameIdx = atoi(argv[6]);
+    float depth_residue = (argc > 7) ? float(atof(argv[7])) : 0.0f;
+    float max_view_angle = (argc > 8) ? float(atof(argv[8])) : 90.0f;
 
     // Load mesh and initialize it
     MeshVisibility* mesh = new MeshVisibility();
@@ -308,12 +445,29 @@ int main(int argc, char** argv)
         delete mesh;
         return -1;
     }
+    if (depth_residue > 0)
+    {
+        PRINT_GREEN("Filter visible vertices by real depth (residue %f m) and viewing angle (%f degree)", depth_residue,
+            max_view_angle);
+        mesh->setDepthFilter(depth_residue, max_view_angle);
+    }
+#ifdef USE_EGL
+    if (program_mode_ == RENDER_MODEL)
+    {
+        PRINT_RED("ERROR: rendering mode needs a window. Rebuild without USE_EGL to use it.");
+        delete mesh;
+        return -1;
+    }
+    if (!initEGL())
+#else
     if (!initGLFW())
+#endif
     {
         delete mesh;
         return -1;
     }
     mesh->initModelDataBuffer();
+#ifndef USE_EGL
     if (program_mode_ == RENDER_MODEL)
     {
         PRINT_GREEN("Rendering mode ... ");
@@ -323,15 +477,20 @@ int main(int argc, char** argv)
         runRenderMode(mesh, kStartFrameIdx, kEndFrameIdx);
     }
     else
+#endif
     {
         PRINT_GREEN("Saving mode ... ");
-        runSaveMode(mesh, kStartFrameIdx, kEndFrameIdx, output_path);
+        runSaveMode(mesh, kStartFrameIdx, kEndFrameIdx, rgbd_path, output_path);
     }
     mesh->deallocate();
     delete mesh;
 
+#ifdef USE_EGL
+    terminateEGL();
+#else
     // Close OpenGL window and terminate GLFW
     glfwTerminate();
+#endif
 
     return 0;
 }
@@ -9,6 +9,9 @@
 MeshVisibility::MeshVisibility()
 {
     vertex_num_ = face_num_ = 0;
+    depth_shift_ = 1000;
+    depth_residue_ = 0;
+    min_view_angle_cos_ = 0;
 }
 
 MeshVisibility::~MeshVisibility()
@@ -619,14 +622,22 @@ void MeshVisibility::saveVisibilityImage2Binary(const string filename)
     fclose(fout);
 }
 
-//! Save only indices of visible vertices into a binary file.
-void MeshVisibility::saveVisibleVertices2Binary(const string filename)
+//! Save only indices of visible vertices into a binary file. If the real depth image of the frame is given and
+//! depth filter is set, a vertex is saved only if at least one of its pixels has rendered depth consistent with the
+//! real depth, and the vertex is not viewed with a too large angle.
+void MeshVisibility::saveVisibleVertices2Binary(const string filename, int frame_idx, const cv::Mat &depth_img)
 {
     image_buffer_.setReadBuffer(GBuffer::GBUFFER_TEXTURE_TYPE_DEPTH);
     glReadPixels(0, 0, kImageWidth, kImageHeight, GL_RGB, GL_FLOAT, image_buffer_arr_);
 
+    bool flag_depth_filter = depth_residue_ > 0 && frame_idx >= 0 && !depth_img.empty();
+    glm::mat4 inv_transform;
+    if (flag_depth_filter)
+        inv_transform = glm::inverse(transforms_[frame_idx]);
+
     // Put indices of visible vertices into an array and save it in binary
     unordered_set<int> set_vlist;
+    unordered_map<int, bool> view_angle_flags;  // vertex index -> viewing angle is valid or not
     for (int i = 0; i < kImageHeight; i++)
     {
         for (int j = 0; j < kImageWidth; j++)
@@ -635,7 +646,21 @@ void MeshVisibility::saveVisibleVertices2Binary(const string filename)
             float vidx = image_buffer_arr_[kImageHeight - i - 1][3 * j + 2];
             // int idx = (vidx > 0 && vidx < 1) ? -1 : int(vidx);
             if (vidx == 0 || vidx >= 1)
-                set_vlist.insert(int(vidx));
+            {
+                if (!flag_depth_filter)
+                {
+                    set_vlist.insert(int(vidx));
+                    continue;
+                }
+                int v = int(vidx);
+                if (set_vlist.count(v))
+                    continue;
+                auto it = view_angle_flags.find(v);
+                if (it == view_angle_flags.end())
+                    it = view_angle_flags.insert(make_pair(v, isVertexViewAngleValid(v, inv_transform))).first;
+                if (it->second && isPixelDepthConsistent(i, j, depth_img))
+                    set_vlist.insert(v);
+            }
         }
     }
     vector<int> vec_vlist(set_vlist.begin(), set_vlist.end());
@@ -646,6 +671,66 @@ void MeshVisibility::saveVisibleVertices2Binary(const string filename)
     fclose(fout);
 }
 
+/************************************************************************/
+/* Depth-consistent visibility */
+
+//! Set depth filter for visibility. 'depth_residue' is in meter and 'max_view_angle' is in degree.
+void MeshVisibility::setDepthFilter(float depth_residue, float max_view_angle)
+{
+    depth_residue_ = depth_residue;
+    min_view_angle_cos_ = cos(glm::radians(max_view_angle));
+    if (depth_residue_ > 0)
+        computeVertexNormals();
+}
+
+//! Compute area-weighted vertex normals from faces. For OBJ model each vertex is only in one face, so its normal
+//! is just the face normal.
+void MeshVisibility::computeVertexNormals()
+{
+    vertex_normals_.assign(vertices_.size(), glm::vec3(0));
+    for (size_t i = 0; i + 2 < faces_.size(); i += 3)
+    {
+        const glm::vec3 &v0 = vertices_[faces_[i]].pos;
+        const glm::vec3 &v1 = vertices_[faces_[i + 1]].pos;
+        const glm::vec3 &v2 = vertices_[faces_[i + 2]].pos;
+        glm::vec3 nor = glm::cross(v1 - v0, v2 - v0);  // length is twice of the face area
+        for (int j = 0; j < 3; ++j)
+            vertex_normals_[faces_[i + j]] += nor;
+    }
+    for (glm::vec3 &nor : vertex_normals_)
+    {
+        float len = glm::length(nor);
+        if (len > 0)
+            nor /= len;
+    }
+}
+
+//! Check if the rendered depth of a pixel (row, col) in rendered image is consistent with the real depth image.
+//! A pixel without any real depth value is not consistent, which is the same as 'mesh_texture_opt'.
+bool MeshVisibility::isPixelDepthConsistent(int row, int col, const cv::Mat &depth_img)
+{
+    // Rendered image and real depth image have the same field of view but may have different resolutions.
+    int y = row * depth_img.rows / int(kImageHeight), x = col * depth_img.cols / int(kImageWidth);
+    unsigned short d = depth_img.at<unsigned short>(y, x);
+    if (d == 0)
+        return false;
+    return fabs(float(d) / depth_shift_ - getCameraDepthValue(row, col)) < depth_residue_;
+}
+
+//! Check the angle between vertex normal and the viewing ray from camera center to the vertex. Vertices viewed
+//! at grazing angles have too much blur and distortion in the color image. Note that normal direction is ignored.
+bool MeshVisibility::isVertexViewAngleValid(int vidx, const glm::mat4 &inv_transform)
+{
+    if (vidx >= int(vertex_normals_.size()))
+        return true;
+    glm::vec3 pt = glm::vec3(inv_transform * glm::vec4(vertices_[vidx].pos, 1.0f));
+    glm::vec3 nor = glm::mat3(inv_transform) * vertex_normals_[vidx];
+    float len = glm::length(pt);
+    if (len == 0)
+        return false;
+    return fabs(glm::dot(nor, pt)) / len >= min_view_angle_cos_;
+}
+
 //! Only for debug: compute some transformation matrix for test
 glm::mat4 MeshVisibility::computeTransformation()
 {
@@ -735,6 +820,7 @@ bool MeshVisibility::readCameraIntrinsicsFile(const string filename)
 {
     // Read intrinsics parameter file
     string target_str = "m_calibrationDepthIntrinsic";
+    string shift_str = "m_depthShift";
     ifstream readin(filename, ios::in);
     if (readin.fail() || readin.eof())
     {
@@ -748,14 +834,18 @@ bool MeshVisibility::readCameraIntrinsicsFile(const string filename)
         getline(readin, str_line);
         if (readin.eof())
             break;
-        if (str_line.substr(0, target_str.length()) == target_str)
+        if (str_line.substr(0, shift_str.length()) == shift_str)
+        {
+            istringstream iss(str_line);
+            iss >> str_dummy >> str_dummy >> depth_shift_;
+        }
+        else if (str_line.substr(0, target_str.length()) == target_str)
         {
             istringstream iss(str_line);
             iss >> str_dummy >> str_dummy;
             iss >> fx_ >> dummy >> cx_ >> dummy >> dummy >> fy_ >> cy_;
 
             computePerspectiveMatrix();
-            break;
         }
     }
     readin.close();
@@ -46,6 +46,7 @@ public:
 	/* Camera parameters */
 	int frame_num_;
 	float fx_, fy_, cx_, cy_; // intrinsic parameters
+	float depth_shift_; // depth value in real depth image divided by this is in meter
 	vector<glm::mat4> transforms_; // extrinsic poses
 	glm::mat4 transform_perspective_; // perspective transformation
 	glm::vec3 camera_initial_center_;
@@ -67,6 +68,11 @@ public:
 	int texture_img_num_;
 	unordered_map<string, int> material_names_;
 
+	/* Depth-consistent visibility (disabled if depth_residue_ <= 0) */
+	float depth_residue_; // max difference between rendered and real depth, in meter
+	float min_view_angle_cos_; // cosine of the max angle between surface normal and viewing ray
+	vector<glm::vec3> vertex_normals_;
+
 public:
 	MeshVisibility();
 	~MeshVisibility();
@@ -84,9 +90,15 @@ public:
 	bool readCameraIntrinsicsFile(const string filepath);
 	void saveColor2PNG(const string filename);
 	void saveDepth2PNG(const string filename);
-	void saveVisibleVertices2Binary(const string filename);
+	void saveVisibleVertices2Binary(const string filename, int frame_idx = -1, const cv::Mat &depth_img = cv::Mat());
 	void saveVisibilityImage2Binary(const string filename);
 
+	/* Depth-consistent visibility */
+	void setDepthFilter(float depth_residue, float max_view_angle);
+	void computeVertexNormals();
+	bool isPixelDepthConsistent(int row, int col, const cv::Mat &depth_img);
+	bool isVertexViewAngleValid(int vidx, const glm::mat4 &inv_transform);
+
 	/* Transformation */
 	glm::mat4 computeTransformation(); // for debug
 	glm::mat4 computeTransformationForFrame(int frame_idx);
@@ -127,6 +139,11 @@ public:
 		// The buffer from shader is upside-down ( y-axis is inversed) from a common 2D image space.
 		return image_buffer_arr_[kImageHeight - row - 1][3 * col]; // channel 0 is depth
 	}
+	// Depth value from rendered image is 'gl_FragCoord.z / gl_FragCoord.w' = far * (z - near) / (far - near),
+	// so convert it back to the real depth z in camera space.
+	float getCameraDepthValue(int row, int col){
+		return getDepthValue(row, col) * (kFar - kNear) / kFar + kNear;
+	}
 };
 
 #endif
@@ -75,6 +75,8 @@ fi
 cp $ROOTPATH/mesh_visibility/*.vert .
 cp $ROOTPATH/mesh_visibility/*.frag .
 $CODEPATH/mesh_visibility -v $PLYNAME"_c"$CLUSTERNUM".ply" $RGBD visibility $START $END
+# Or filter visible vertices with real depth images (5cm depth residue, 80 degree max viewing angle)
+# $CODEPATH/mesh_visibility -v $PLYNAME"_c"$CLUSTERNUM".ply" $RGBD visibility $START $END 0.05 80
 rm *.vert
 rm *.frag
 